@@ -1,252 +1,6304 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <cctype>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define HAVE_SSSE3_DISPATCH 1
+#endif
 
-class Memento {
-    friend class DynamicArray;
-    friend class CareTaker;
+// Runs task(0) .. task(count - 1) on all available cores.
+template <typename Task>
+void parallelFor(size_t count, Task task) {
+    size_t workers = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            task(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers; w++) {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                task(i);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
 
-private:
-    char* savedData;
-    size_t savedSize;
-    size_t savedCapacity;
+// Sorts runs of items on all cores, then merges neighbouring runs pairwise
+// until one is left.
+template <typename Item>
+void parallelSort(std::vector<Item>& items) {
+    static constexpr size_t MIN_RUN = 16 * 1024;
+    size_t runs = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), items.size() / MIN_RUN + 1);
+    std::vector<size_t> bounds(runs + 1);
+    for (size_t i = 0; i <= runs; i++) {
+        bounds[i] = items.size() * i / runs;
+    }
+    parallelFor(runs, [&](size_t i) {
+        std::sort(items.begin() + bounds[i], items.begin() + bounds[i + 1]);
+    });
+    for (size_t width = 1; width < runs; width *= 2) {
+        parallelFor((runs + 2 * width - 1) / (2 * width), [&](size_t pair) {
+            size_t first = pair * 2 * width;
+            size_t middle = std::min(runs, first + width);
+            size_t last = std::min(runs, first + 2 * width);
+            std::inplace_merge(items.begin() + bounds[first], items.begin() + bounds[middle], items.begin() + bounds[last]);
+        });
+    }
+}
+
+// Length of the UTF-8 sequence starting at p, 0 if it is malformed,
+// or -1 if it is cut off by end.
+int utf8SequenceLength(const unsigned char* p, const unsigned char* end) {
+    unsigned char lead = p[0];
+    if (lead < 0x80) {
+        return 1;
+    }
+    int len;
+    unsigned char low = 0x80, high = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        len = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        len = 3;
+        if (lead == 0xE0) {
+            low = 0xA0;
+        }
+        if (lead == 0xED) {
+            high = 0x9F;
+        }
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        len = 4;
+        if (lead == 0xF0) {
+            low = 0x90;
+        }
+        if (lead == 0xF4) {
+            high = 0x8F;
+        }
+    } else {
+        return 0;
+    }
+    for (int i = 1; i < len; i++) {
+        if (p + i >= end) {
+            return -1;
+        }
+        unsigned char c = p[i];
+        if (c < low || c > high) {
+            return 0;
+        }
+        low = 0x80;
+        high = 0xBF;
+    }
+    return len;
+}
+
+// Length of the common prefix of a and b, comparing up to n bytes.
+size_t commonPrefix(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+        if (differ != 0) {
+            return i + __builtin_ctz(differ);
+        }
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x, y;
+        std::memcpy(&x, a + i, 8);
+        std::memcpy(&y, b + i, 8);
+        if (x != y) {
+            return i + __builtin_ctzll(x ^ y) / 8;
+        }
+    }
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
 
-    Memento(const char* data, size_t size, size_t capacity)
-            : savedSize(size), savedCapacity(capacity) {
-        savedData = new char[savedCapacity];
-        std::memcpy(savedData, data, savedSize);
+// Length of the common suffix of the n bytes ending at aEnd and bEnd.
+size_t commonSuffix(const char* aEnd, const char* bEnd, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aEnd - i - 16));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bEnd - i - 16));
+        unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+        if (differ != 0) {
+            return i + __builtin_clz(differ) - 16;
+        }
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x, y;
+        std::memcpy(&x, aEnd - i - 8, 8);
+        std::memcpy(&y, bEnd - i - 8, 8);
+        if (x != y) {
+            return i + __builtin_clzll(x ^ y) / 8;
+        }
+    }
+    while (i < n && aEnd[-1 - static_cast<long>(i)] == bEnd[-1 - static_cast<long>(i)]) {
+        i++;
+    }
+    return i;
+}
+
+inline bool isContinuationByte(char c) {
+    return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+}
+
+inline bool isWordSeparator(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+#ifdef __SSE2__
+// Bit i is set when byte i of the 16 at p is a word separator.
+inline int separatorMask(const char* p) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))),
+                                 _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r'))));
+    return _mm_movemask_epi8(found);
+}
+#endif
+
+// First position at or after pos whose byte is (or, with separator false,
+// is not) a word separator; end if there is none.
+size_t scanWordBoundary(const char* data, size_t pos, size_t end, bool separator) {
+#ifdef __SSE2__
+    for (; pos + 16 <= end; pos += 16) {
+        int mask = separatorMask(data + pos);
+        if (!separator) {
+            mask = ~mask & 0xFFFF;
+        }
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (pos < end && isWordSeparator(data[pos]) != separator) {
+        pos++;
     }
+    return pos;
+}
 
-    ~Memento() {
-        delete[] savedData;
+// Skips the run of ASCII bytes starting at pos, 16 at a time with SSE2.
+size_t skipAscii(const unsigned char* p, size_t pos, size_t end) {
+#ifdef __SSE2__
+    for (; pos + 16 <= end; pos += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + pos)));
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
     }
+#endif
+    while (pos < end && p[pos] < 0x80) {
+        pos++;
+    }
+    return pos;
+}
+
+// Result of validating one chunk of a file. Sequences crossing the chunk
+// boundaries are checked when the chunks are merged.
+struct Utf8ChunkScan {
+    bool valid = true;
+    size_t headSkip = 0;  // continuation bytes belonging to the previous chunk
+    size_t tailPos = 0;   // start of a sequence cut off by the chunk end
+    bool pendingTail = false;
 };
 
-class CareTaker {
+Utf8ChunkScan scanUtf8Chunk(const char* text, size_t begin, size_t end, size_t total) {
+    Utf8ChunkScan scan;
+    auto p = reinterpret_cast<const unsigned char*>(text);
+    size_t pos = begin;
+    if (begin > 0) {
+        while (pos < end && pos < begin + 3 && (p[pos] & 0xC0) == 0x80) {
+            pos++;
+        }
+    }
+    scan.headSkip = pos - begin;
+    while ((pos = skipAscii(p, pos, end)) < end) {
+        int len = utf8SequenceLength(p + pos, p + end);
+        if (len > 0) {
+            pos += len;
+        } else if (len < 0 && end < total) {
+            scan.pendingTail = true;
+            scan.tailPos = pos;
+            break;
+        } else {
+            scan.valid = false;
+            break;
+        }
+    }
+    return scan;
+}
+
+bool mergeUtf8Scans(const char* text, size_t total, const std::vector<Utf8ChunkScan>& scans, size_t chunkSize) {
+    auto p = reinterpret_cast<const unsigned char*>(text);
+    size_t expectedSkip = 0;
+    for (size_t i = 0; i < scans.size(); i++) {
+        const Utf8ChunkScan& scan = scans[i];
+        if (!scan.valid || scan.headSkip != expectedSkip) {
+            return false;
+        }
+        expectedSkip = 0;
+        if (scan.pendingTail) {
+            int len = utf8SequenceLength(p + scan.tailPos, p + total);
+            if (len <= 0) {
+                return false;
+            }
+            expectedSkip = scan.tailPos + len - (i + 1) * chunkSize;
+        }
+    }
+    return true;
+}
+
+// Whether the characters around bytes [begin, end) of a text of size bytes
+// are valid: from the start of the one holding begin to the end of the one
+// holding end - 1, and any continuation bytes after that. If the text was
+// valid before bytes there changed, this tells whether it still is.
+bool validUtf8Around(const char* text, size_t size, size_t begin, size_t end) {
+    auto p = reinterpret_cast<const unsigned char*>(text);
+    for (int i = 0; i < 3 && begin > 0 && begin < size && (p[begin] & 0xC0) == 0x80; i++) {
+        begin--;
+    }
+    for (int i = 0; i < 3 && end < size && (p[end] & 0xC0) == 0x80; i++) {
+        end++;
+    }
+    for (size_t pos = begin; (pos = skipAscii(p, pos, end)) < end;) {
+        int len = utf8SequenceLength(p + pos, p + size);
+        if (len <= 0) {
+            return false;
+        }
+        pos += len;
+    }
+    return true;
+}
+
+// Simple lowercase folding for ASCII, Latin-1, Greek (with the accented
+// capitals, and final sigma folded to sigma) and Cyrillic. Every mapping
+// keeps the UTF-8 length, so a folded match is as long as the pattern.
+uint32_t foldCodepoint(uint32_t cp) {
+    if ((cp >= 'A' && cp <= 'Z') || (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7)
+        || (cp >= 0x391 && cp <= 0x3AB && cp != 0x3A2) || (cp >= 0x410 && cp <= 0x42F)) {
+        return cp + 0x20;
+    }
+    if (cp >= 0x400 && cp <= 0x40F) {
+        return cp + 0x50;
+    }
+    switch (cp) {
+    case 0x386:
+        return 0x3AC;
+    case 0x388: case 0x389: case 0x38A:
+        return cp + 0x25;
+    case 0x38C:
+        return 0x3CC;
+    case 0x38E: case 0x38F:
+        return cp + 0x3F;
+    case 0x3C2:
+        return 0x3C3;
+    }
+    return cp;
+}
+
+// Inverse of foldCodepoint for the folded characters; for sigma it is the
+// capital, the final form being the only other one.
+uint32_t unfoldCodepoint(uint32_t cp) {
+    if ((cp >= 'a' && cp <= 'z') || (cp >= 0xE0 && cp <= 0xFE && cp != 0xF7)
+        || (cp >= 0x3B1 && cp <= 0x3CB && cp != 0x3C2) || (cp >= 0x430 && cp <= 0x44F)) {
+        return cp - 0x20;
+    }
+    if (cp >= 0x450 && cp <= 0x45F) {
+        return cp - 0x50;
+    }
+    switch (cp) {
+    case 0x3AC:
+        return 0x386;
+    case 0x3AD: case 0x3AE: case 0x3AF:
+        return cp - 0x25;
+    case 0x3CC:
+        return 0x38C;
+    case 0x3CD: case 0x3CE:
+        return cp - 0x3F;
+    }
+    return cp;
+}
+
+// Folded code point of the character at p when it is ASCII or a two-byte
+// sequence; any other byte stands for itself, marked so it cannot equal a
+// code point. len gets the number of bytes used.
+inline uint32_t foldedCharAt(const unsigned char* p, const unsigned char* end, int& len) {
+    if (p[0] >= 0xC2 && p[0] <= 0xDF && p + 1 < end && (p[1] & 0xC0) == 0x80) {
+        len = 2;
+        return foldCodepoint(((p[0] & 0x1F) << 6) | (p[1] & 0x3F));
+    }
+    len = 1;
+    return p[0] < 0x80 ? foldCodepoint(p[0]) : 0x80000000u | p[0];
+}
+
+inline bool isSearchWordChar(unsigned char c) {
+    return c >= 0x80 || c == '_' || std::isalnum(c);
+}
+
+struct SearchOptions {
+    bool ignoreCase = false;
+    bool wholeWord = false;
+
+    bool operator==(const SearchOptions& other) const {
+        return ignoreCase == other.ignoreCase && wholeWord == other.wholeWord;
+    }
+};
+
+// A pattern prepared for searching. Candidate positions are those whose
+// first and last byte match the pattern's, tested 16 positions at a time
+// with SSE2; with ignoreCase each end accepts the byte of any case form.
+// Candidates are then checked in full, folding one character at a time.
+class SearchPattern {
 private:
-    std::vector<Memento*> undoStack;
-    std::vector<Memento*> redoStack;
+    std::string pattern;
+    SearchOptions searchOptions;
+    static constexpr int CASE_FORMS = 3;  // sigma has a capital and a final form
+
+    unsigned char first[CASE_FORMS];
+    unsigned char last[CASE_FORMS];
+
+    // First or last UTF-8 byte of the character at c in each case form.
+    static void caseBytes(const unsigned char* c, const unsigned char* end, bool lastByte, unsigned char bytes[CASE_FORMS]) {
+        int len;
+        uint32_t folded = foldedCharAt(c, end, len);
+        if (folded & 0x80000000u) {
+            bytes[0] = bytes[1] = bytes[2] = c[0];
+            return;
+        }
+        uint32_t cases[CASE_FORMS] = {folded, unfoldCodepoint(folded), folded == 0x3C3 ? 0x3C2u : folded};
+        for (int i = 0; i < CASE_FORMS; i++) {
+            if (len == 1) {
+                bytes[i] = static_cast<unsigned char>(cases[i]);
+            } else {
+                bytes[i] = lastByte ? 0x80 | (cases[i] & 0x3F) : 0xC0 | (cases[i] >> 6);
+            }
+        }
+    }
+
+    bool isCandidate(const char* p) const {
+        unsigned char head = p[0];
+        unsigned char tail = p[pattern.size() - 1];
+        return (head == first[0] || head == first[1] || head == first[2])
+            && (tail == last[0] || tail == last[1] || tail == last[2]);
+    }
+
+#ifdef __SSE2__
+    // Bit i is set when position p + i is a candidate.
+    int candidateMask(const char* p) const {
+        __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + pattern.size() - 1));
+        __m128i headMatch = _mm_setzero_si128();
+        __m128i tailMatch = _mm_setzero_si128();
+        for (int i = 0; i < CASE_FORMS; i++) {
+            headMatch = _mm_or_si128(headMatch, _mm_cmpeq_epi8(head, _mm_set1_epi8(static_cast<char>(first[i]))));
+            tailMatch = _mm_or_si128(tailMatch, _mm_cmpeq_epi8(tail, _mm_set1_epi8(static_cast<char>(last[i]))));
+        }
+        return _mm_movemask_epi8(_mm_and_si128(headMatch, tailMatch));
+    }
+#endif
+
+    bool matchesAt(const char* data, size_t size, size_t pos) const {
+        size_t len = pattern.size();
+        if (!searchOptions.ignoreCase) {
+            if (std::memcmp(data + pos, pattern.data(), len) != 0) {
+                return false;
+            }
+        } else {
+            auto text = reinterpret_cast<const unsigned char*>(data + pos);
+            auto want = reinterpret_cast<const unsigned char*>(pattern.data());
+            for (size_t i = 0; i < len;) {
+                int textLen, wantLen;
+                if (foldedCharAt(text + i, text + len, textLen) != foldedCharAt(want + i, want + len, wantLen) || textLen != wantLen) {
+                    return false;
+                }
+                i += wantLen;
+            }
+        }
+        if (searchOptions.wholeWord) {
+            if (pos > 0 && isSearchWordChar(data[pos - 1])) {
+                return false;
+            }
+            if (pos + len < size && isSearchWordChar(data[pos + len])) {
+                return false;
+            }
+        }
+        return true;
+    }
 
 public:
-    void saveState(const char* data, size_t size, size_t capacity) {
-        auto memento = new Memento(data, size, capacity);
-        undoStack.push_back(memento);
+    static constexpr size_t npos = SIZE_MAX;
 
-        for (auto &memento : redoStack) {
-            delete memento;
+    SearchPattern(const std::string& search, SearchOptions options) : pattern(search), searchOptions(options) {
+        if (search.empty()) {
+            return;
+        }
+        auto p = reinterpret_cast<const unsigned char*>(search.data());
+        auto end = p + search.size();
+        first[0] = first[1] = first[2] = p[0];
+        last[0] = last[1] = last[2] = end[-1];
+        if (options.ignoreCase) {
+            int len;
+            size_t lastStart = 0;
+            for (size_t i = 0; i < search.size(); i += len) {
+                foldedCharAt(p + i, end, len);
+                lastStart = i;
+            }
+            caseBytes(p, end, false, first);
+            caseBytes(p + lastStart, end, true, last);
         }
-        redoStack.clear();
     }
 
-    void pushToUndo(const char* data, size_t size, size_t capacity) {
-        auto memento = new Memento(data, size, capacity);
-        undoStack.push_back(memento);
+    const std::string& text() const {
+        return pattern;
     }
 
-    void pushToRedo(const char* data, size_t size, size_t capacity) {
-        auto memento = new Memento(data, size, capacity);
-        redoStack.push_back(memento);
+    SearchOptions options() const {
+        return searchOptions;
     }
 
-    Memento* undo() {
-        if (!undoStack.empty()) {
-            auto memento = undoStack.back();
-            undoStack.pop_back();
-            return memento;
+    // First match starting at or after from and before until, or npos.
+    size_t find(const char* data, size_t size, size_t from, size_t until = npos) const {
+        size_t len = pattern.size();
+        if (len == 0) {
+            return from <= size && from < until ? from : npos;
         }
-        return nullptr;
+        if (len > size || until == 0) {
+            return npos;
+        }
+        size_t lastStart = std::min(size - len, until - 1);
+        size_t pos = from;
+#ifdef __SSE2__
+        for (; pos + 16 <= lastStart + 1; pos += 16) {
+            int mask = candidateMask(data + pos);
+            while (mask != 0) {
+                size_t candidate = pos + __builtin_ctz(mask);
+                if (matchesAt(data, size, candidate)) {
+                    return candidate;
+                }
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; pos <= lastStart; pos++) {
+            if (isCandidate(data + pos) && matchesAt(data, size, pos)) {
+                return pos;
+            }
+        }
+        return npos;
     }
 
-    Memento* redo() {
-        if (!redoStack.empty()) {
-            auto memento = redoStack.back();
-            redoStack.pop_back();
-            return memento;
+    // Last match starting before the given position, or npos. Scans
+    // backwards, so stepping through matches costs only the distance
+    // between them.
+    size_t rfind(const char* data, size_t size, size_t before) const {
+        size_t len = pattern.size();
+        if (len == 0) {
+            return before > 0 ? std::min(before - 1, size) : npos;
         }
-        return nullptr;
+        if (len > size) {
+            return npos;
+        }
+        size_t pos = std::min(before, size - len + 1);
+#ifdef __SSE2__
+        for (; pos >= 16; pos -= 16) {
+            int mask = candidateMask(data + pos - 16);
+            while (mask != 0) {
+                int bit = 31 - __builtin_clz(mask);
+                if (matchesAt(data, size, pos - 16 + bit)) {
+                    return pos - 16 + bit;
+                }
+                mask &= ~(1 << bit);
+            }
+        }
+#endif
+        while (pos > 0) {
+            pos--;
+            if (isCandidate(data + pos) && matchesAt(data, size, pos)) {
+                return pos;
+            }
+        }
+        return npos;
     }
+};
 
-    ~CareTaker() {
-        for (auto &memento : undoStack) {
-            delete memento;
+// Results of recent findAll queries, keyed by pattern and options. The
+// owner reports every edit, and each entry is patched in place: matches
+// near the edit are dropped and that stretch is searched again, and
+// later matches are shifted. Entries always describe the current text.
+class SearchCache {
+private:
+    static constexpr size_t MAX_ENTRIES = 8;
+
+    struct Entry {
+        SearchPattern pattern;
+        std::vector<size_t> matches;
+    };
+
+    // Most recently used first.
+    std::deque<Entry> entries;
+
+public:
+    const std::vector<size_t>& findAll(const char* data, size_t size, const std::string& text, SearchOptions options) {
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->pattern.text() == text && it->pattern.options() == options) {
+                if (it != entries.begin()) {
+                    Entry entry = std::move(*it);
+                    entries.erase(it);
+                    entries.push_front(std::move(entry));
+                }
+                return entries.front().matches;
+            }
         }
-        for (auto &memento : redoStack) {
-            delete memento;
+        Entry entry{SearchPattern(text, options), {}};
+        if (!text.empty()) {
+            for (size_t pos = entry.pattern.find(data, size, 0); pos != SearchPattern::npos; pos = entry.pattern.find(data, size, pos + 1)) {
+                entry.matches.push_back(pos);
+            }
+        }
+        if (entries.size() == MAX_ENTRIES) {
+            entries.pop_back();
+        }
+        entries.push_front(std::move(entry));
+        return entries.front().matches;
+    }
+
+    // Length of the longest cached pattern; an update reads that far back.
+    size_t longestPattern() const {
+        size_t longest = 0;
+        for (auto &entry : entries) {
+            longest = std::max(longest, entry.pattern.text().size());
+        }
+        return longest;
+    }
+
+    // Called after oldLen bytes at pos became newLen bytes. A match can
+    // change if it overlaps the edit or touches it, since whole-word
+    // matches depend on the neighbouring bytes.
+    void update(const char* data, size_t size, size_t pos, size_t oldLen, size_t newLen) {
+        for (auto &entry : entries) {
+            size_t len = entry.pattern.text().size();
+            if (len == 0) {
+                continue;
+            }
+            size_t begin = pos > len ? pos - len : 0;
+            std::vector<size_t>& matches = entry.matches;
+            auto first = std::lower_bound(matches.begin(), matches.end(), begin);
+            auto last = std::upper_bound(first, matches.end(), pos + oldLen);
+            std::vector<size_t> found;
+            for (size_t at = entry.pattern.find(data, size, begin, pos + newLen + 1); at != SearchPattern::npos;
+                 at = entry.pattern.find(data, size, at + 1, pos + newLen + 1)) {
+                found.push_back(at);
+            }
+            for (auto it = last; it != matches.end(); ++it) {
+                *it = *it - oldLen + newLen;
+            }
+            size_t index = first - matches.begin();
+            matches.erase(first, last);
+            matches.insert(matches.begin() + index, found.begin(), found.end());
         }
     }
+
+    void clear() {
+        entries.clear();
+    }
 };
 
-class DynamicArray {
+struct PatternMatch {
+    size_t pos;
+    size_t pattern;
+
+    bool operator<(const PatternMatch& other) const {
+        return pos != other.pos ? pos < other.pos : pattern < other.pattern;
+    }
+};
+
+// Finds every occurrence of a set of patterns in one pass over the text.
+// Up to TEDDY_PATTERNS patterns use a Teddy filter: each pattern owns one
+// bit, and nibble lookup tables for its first few bytes flag the positions
+// where some pattern may start, 16 at a time with SSSE3 when the CPU has
+// it. Larger sets run an Aho-Corasick automaton with a full transition
+// table.
+class MultiPattern {
 private:
-    char* data;
-    size_t size;
-    size_t capacity;
-    CareTaker careTaker;
-    std::string clipboard;
+    static constexpr size_t TEDDY_PATTERNS = 8;
+    static constexpr size_t TEDDY_BYTES = 3;
 
-    void resize(size_t newCapacity) {
-        char* newData = new char[newCapacity];
-        std::memcpy(newData, data, size);
-        delete[] data;
-        data = newData;
-        capacity = newCapacity;
+    std::vector<std::string> patterns;
+    size_t teddyBytes = 0;
+    alignas(16) uint8_t lowNibble[TEDDY_BYTES][16] = {};
+    alignas(16) uint8_t highNibble[TEDDY_BYTES][16] = {};
+    std::vector<int32_t> transitions;
+    std::vector<std::vector<size_t>> outputs;
+
+    void buildTeddy() {
+        teddyBytes = TEDDY_BYTES;
+        for (auto &pattern : patterns) {
+            teddyBytes = std::min(teddyBytes, pattern.size());
+        }
+        for (size_t p = 0; p < patterns.size(); p++) {
+            for (size_t k = 0; k < teddyBytes; k++) {
+                auto c = static_cast<unsigned char>(patterns[p][k]);
+                lowNibble[k][c & 0x0F] |= 1 << p;
+                highNibble[k][c >> 4] |= 1 << p;
+            }
+        }
     }
 
-public:
-    DynamicArray() : size(0), capacity(10) {
-        data = new char[capacity];
-        data[0] = '\0';
+    void buildAutomaton() {
+        transitions.assign(256, 0);
+        outputs.assign(1, {});
+        for (size_t p = 0; p < patterns.size(); p++) {
+            if (patterns[p].empty()) {
+                continue;
+            }
+            int32_t state = 0;
+            for (unsigned char c : patterns[p]) {
+                if (transitions[state * 256 + c] == 0) {
+                    transitions[state * 256 + c] = static_cast<int32_t>(outputs.size());
+                    transitions.resize(transitions.size() + 256, 0);
+                    outputs.emplace_back();
+                }
+                state = transitions[state * 256 + c];
+            }
+            outputs[state].push_back(p);
+        }
+        // Breadth-first, so a state's failure state is final before its children need it.
+        std::vector<int32_t> failure(outputs.size(), 0);
+        std::deque<int32_t> queue;
+        for (int c = 0; c < 256; c++) {
+            if (transitions[c] != 0) {
+                queue.push_back(transitions[c]);
+            }
+        }
+        while (!queue.empty()) {
+            int32_t state = queue.front();
+            queue.pop_front();
+            const std::vector<size_t>& inherited = outputs[failure[state]];
+            outputs[state].insert(outputs[state].end(), inherited.begin(), inherited.end());
+            for (int c = 0; c < 256; c++) {
+                int32_t& next = transitions[state * 256 + c];
+                int32_t fallback = transitions[failure[state] * 256 + c];
+                if (next != 0) {
+                    failure[next] = fallback;
+                    queue.push_back(next);
+                } else {
+                    next = fallback;
+                }
+            }
+        }
     }
 
-    ~DynamicArray() {
-        delete[] data;
+    // Patterns that may start at pos, one bit each.
+    uint32_t teddyCandidates(const unsigned char* text, size_t pos) const {
+        uint32_t bits = 0xFF;
+        for (size_t k = 0; k < teddyBytes; k++) {
+            unsigned char c = text[pos + k];
+            bits &= lowNibble[k][c & 0x0F] & highNibble[k][c >> 4];
+        }
+        return bits;
     }
 
-    void append(const char* text) {
-        careTaker.saveState(data, size, capacity);
-        size_t len = strlen(text);
-        while (size + len >= capacity) {
-            resize(capacity * 2);
+    void verify(const char* data, size_t size, size_t pos, uint32_t bits, std::vector<PatternMatch>& matches) const {
+        while (bits != 0) {
+            size_t p = __builtin_ctz(bits);
+            bits &= bits - 1;
+            const std::string& pattern = patterns[p];
+            if (pattern.size() <= size - pos && std::memcmp(data + pos, pattern.data(), pattern.size()) == 0) {
+                matches.push_back({pos, p});
+            }
         }
-        std::strcpy(data + size, text);
-        size += len;
     }
 
-    void insertAndReplace(size_t pos, const char* substring, size_t replaceLen) {
-        careTaker.saveState(data, size, capacity);
-        size_t len = strlen(substring);
-        if (size + len - replaceLen >= capacity) {
-            resize((size + len - replaceLen) * 2);
+#ifdef HAVE_SSSE3_DISPATCH
+    // Returns the first position it did not scan.
+    __attribute__((target("ssse3")))
+    size_t teddyScanSsse3(const char* data, size_t size, std::vector<PatternMatch>& matches) const {
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        size_t pos = 0;
+        for (; pos + 16 + teddyBytes - 1 <= size; pos += 16) {
+            __m128i bits = _mm_set1_epi8(-1);
+            for (size_t k = 0; k < teddyBytes; k++) {
+                __m128i text = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos + k));
+                __m128i low = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(lowNibble[k])), _mm_and_si128(text, nibble));
+                __m128i high = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(highNibble[k])), _mm_and_si128(_mm_srli_epi16(text, 4), nibble));
+                bits = _mm_and_si128(bits, _mm_and_si128(low, high));
+            }
+            int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) & 0xFFFF;
+            if (mask == 0) {
+                continue;
+            }
+            alignas(16) uint8_t lanes[16];
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes), bits);
+            while (mask != 0) {
+                int lane = __builtin_ctz(mask);
+                mask &= mask - 1;
+                verify(data, size, pos + lane, lanes[lane], matches);
+            }
         }
-        std::memmove(data + pos + len, data + pos + replaceLen, size - pos - replaceLen + 1);
-        std::memcpy(data + pos, substring, len);
-        size = size + len - replaceLen;
+        return pos;
     }
+#endif
 
-    void deleteText(size_t pos, size_t len) {
-        careTaker.saveState(data, size, capacity);
-        if (pos >= size || pos + len > size) {
-            std::cout << "Invalid position or length.\n";
-            return;
+public:
+    // Empty patterns never match.
+    explicit MultiPattern(const std::vector<std::string>& texts) : patterns(texts) {
+        if (useTeddy()) {
+            buildTeddy();
+        } else {
+            buildAutomaton();
+        }
+    }
+
+    bool useTeddy() const {
+        if (patterns.size() > TEDDY_PATTERNS) {
+            return false;
+        }
+        for (auto &pattern : patterns) {
+            if (pattern.empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Every occurrence, overlapping ones included, ordered by position and
+    // then by pattern index.
+    std::vector<PatternMatch> findAll(const char* data, size_t size) const {
+        std::vector<PatternMatch> matches;
+        if (patterns.empty()) {
+            return matches;
+        }
+        if (useTeddy()) {
+            auto text = reinterpret_cast<const unsigned char*>(data);
+            size_t pos = 0;
+#ifdef HAVE_SSSE3_DISPATCH
+            if (__builtin_cpu_supports("ssse3")) {
+                pos = teddyScanSsse3(data, size, matches);
+            }
+#endif
+            for (; pos + teddyBytes <= size; pos++) {
+                uint32_t bits = teddyCandidates(text, pos);
+                if (bits != 0) {
+                    verify(data, size, pos, bits, matches);
+                }
+            }
+            return matches;
+        }
+        int32_t state = 0;
+        for (size_t i = 0; i < size; i++) {
+            state = transitions[state * 256 + static_cast<unsigned char>(data[i])];
+            for (size_t p : outputs[state]) {
+                matches.push_back({i + 1 - patterns[p].size(), p});
+            }
+        }
+        std::sort(matches.begin(), matches.end());
+        return matches;
+    }
+};
+
+struct FuzzyMatch {
+    size_t pos;
+    size_t length;
+    size_t distance;
+};
+
+// Approximate search within maxEdits insertions, deletions or
+// substitutions, using Myers' bit-parallel algorithm: one 64-bit word holds
+// a column of the edit distance matrix, so patterns are at most 64 bytes.
+// The text is scanned in parallel chunks. Each chunk starts pattern length
+// plus maxEdits bytes early, which is the longest a match can be.
+class FuzzyPattern {
+private:
+    static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+
+    std::string pattern;
+    size_t maxEdits;
+    uint64_t forward[256] = {};
+    uint64_t backward[256] = {};
+
+    // Advances one text byte. carry is the change along the top row: 0
+    // lets a match start anywhere, 1 anchors it at the first byte read.
+    static void step(uint64_t eq, uint64_t& pv, uint64_t& mv, size_t& score, uint64_t high, uint64_t carry) {
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & high) {
+            score++;
+        } else if (mh & high) {
+            score--;
+        }
+        ph = (ph << 1) | carry;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+
+    // Candidates ending in (begin, end], one per end position.
+    void scanChunk(const char* data, size_t begin, size_t end, std::vector<FuzzyMatch>& found) const {
+        size_t m = pattern.size();
+        uint64_t pv = ~0ULL, mv = 0;
+        size_t score = m;
+        for (size_t i = begin >= m + maxEdits ? begin - m - maxEdits : 0; i < end; i++) {
+            step(forward[static_cast<unsigned char>(data[i])], pv, mv, score, 1ULL << (m - 1), 0);
+            if (i >= begin && score <= maxEdits) {
+                size_t length = matchLength(data, i + 1);
+                found.push_back({i + 1 - length, length, score});
+            }
+        }
+    }
+
+    // Length of the closest match ending at end, found by running the
+    // reversed pattern backwards from there.
+    size_t matchLength(const char* data, size_t end) const {
+        size_t m = pattern.size();
+        uint64_t pv = ~0ULL, mv = 0;
+        size_t score = m, best = m, length = 0;
+        for (size_t t = 1; t <= m + maxEdits && t <= end; t++) {
+            step(backward[static_cast<unsigned char>(data[end - t])], pv, mv, score, 1ULL << (m - 1), 1);
+            if (score < best) {
+                best = score;
+                length = t;
+            }
+        }
+        return length;
+    }
+
+public:
+    static constexpr size_t MAX_PATTERN = 64;
+
+    FuzzyPattern(const std::string& search, size_t edits) : pattern(search), maxEdits(edits) {
+        size_t m = std::min(search.size(), MAX_PATTERN);
+        for (size_t i = 0; i < m; i++) {
+            forward[static_cast<unsigned char>(search[i])] |= 1ULL << i;
+            backward[static_cast<unsigned char>(search[m - 1 - i])] |= 1ULL << i;
+        }
+    }
+
+    bool valid() const {
+        return !pattern.empty() && pattern.size() <= MAX_PATTERN && maxEdits < pattern.size();
+    }
+
+    // Non-overlapping matches, closest first and then by position. Every
+    // position where the distance is within bounds ends a candidate; where
+    // candidates overlap, the better ranked one is kept.
+    std::vector<FuzzyMatch> findAll(const char* data, size_t size) const {
+        std::vector<FuzzyMatch> matches;
+        if (!valid()) {
+            return matches;
+        }
+        size_t chunks = std::max<size_t>(1, (size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+        std::vector<std::vector<FuzzyMatch>> found(chunks);
+        parallelFor(chunks, [&](size_t i) {
+            scanChunk(data, i * CHUNK_SIZE, std::min(size, (i + 1) * CHUNK_SIZE), found[i]);
+        });
+        for (auto &part : found) {
+            matches.insert(matches.end(), part.begin(), part.end());
+        }
+        std::stable_sort(matches.begin(), matches.end(), [](const FuzzyMatch& a, const FuzzyMatch& b) {
+            return a.distance < b.distance;
+        });
+        std::map<size_t, size_t> kept;
+        std::vector<FuzzyMatch> ranked;
+        for (auto &match : matches) {
+            auto after = kept.lower_bound(match.pos);
+            if (after != kept.end() && after->first < match.pos + match.length) {
+                continue;
+            }
+            if (after != kept.begin() && std::prev(after)->second > match.pos) {
+                continue;
+            }
+            kept[match.pos] = match.pos + match.length;
+            ranked.push_back(match);
+        }
+        return ranked;
+    }
+};
+
+inline uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// 64-bit xxHash (XXH64) used for file, chunk and block checksums. The four
+// stripe accumulators are independent, so their multiplies overlap in the
+// pipeline; x86 has no packed 64-bit multiply below AVX-512.
+uint64_t hashBytes(const char* p, size_t len, uint64_t seed = 0) {
+    const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+    const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+    const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+    auto read64 = [](const char* q) {
+        uint64_t k;
+        std::memcpy(&k, q, 8);
+        return k;
+    };
+    auto round = [&](uint64_t acc, uint64_t input) {
+        return rotateLeft(acc + input * PRIME2, 31) * PRIME1;
+    };
+    const char* end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        for (uint64_t v : {v1, v2, v3, v4}) {
+            h = (h ^ round(0, v)) * PRIME1 + PRIME4;
+        }
+    } else {
+        h = seed + PRIME5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= round(0, read64(p));
+        h = rotateLeft(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        uint32_t k;
+        std::memcpy(&k, p, 4);
+        h ^= k * PRIME1;
+        h = rotateLeft(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= static_cast<unsigned char>(*p) * PRIME5;
+        h = rotateLeft(h, 11) * PRIME1;
+    }
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Content-addressed store of immutable text chunks shared by all documents,
+// snapshots and clipboards. Chunks are reference counted by shared_ptr; the
+// store holds weak references and sweeps expired ones as it grows. It is
+// sharded by chunk hash, each shard with its own lock, so the parallel
+// chunkers rarely wait for each other.
+class ChunkStore {
+public:
+    using Chunk = std::shared_ptr<const std::string>;
+
+private:
+    struct alignas(64) Shard {
+        std::unordered_multimap<uint64_t, std::weak_ptr<const std::string>> chunks;
+        std::mutex mutex;
+        size_t sweepAt = 64;
+
+        void sweep() {
+            for (auto it = chunks.begin(); it != chunks.end();) {
+                it = it->second.expired() ? chunks.erase(it) : std::next(it);
+            }
+        }
+    };
+
+    static constexpr size_t SHARDS = 64;
+    Shard shards[SHARDS];
+
+public:
+    static ChunkStore& shared() {
+        static ChunkStore store;
+        return store;
+    }
+
+    // The stored chunk equal to [p, p + len), added if there is none.
+    Chunk intern(const char* p, size_t len, uint64_t hash) {
+        Shard& shard = shards[hash % SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto range = shard.chunks.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            Chunk chunk = it->second.lock();
+            if (chunk && chunk->size() == len && std::memcmp(chunk->data(), p, len) == 0) {
+                return chunk;
+            }
+        }
+        if (shard.chunks.size() >= shard.sweepAt) {
+            shard.sweep();
+            shard.sweepAt = std::max<size_t>(64, 2 * shard.chunks.size());
+        }
+        Chunk chunk = std::make_shared<const std::string>(p, len);
+        shard.chunks.emplace(hash, chunk);
+        return chunk;
+    }
+
+    // Live chunks and the bytes they hold.
+    void usage(size_t& count, size_t& bytes) {
+        count = 0;
+        bytes = 0;
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.sweep();
+            for (auto &entry : shard.chunks) {
+                if (Chunk chunk = entry.second.lock()) {
+                    count++;
+                    bytes += chunk->size();
+                }
+            }
+        }
+    }
+};
+
+// Immutable text held as a list of stored chunks. Chunk boundaries are
+// content-defined by a gear rolling hash over the last 64 bytes, so equal
+// regions of different texts are cut alike and share their chunks. Copies
+// share the list itself, so copying costs O(1).
+class ChunkedText {
+public:
+    using ChunkList = std::vector<ChunkStore::Chunk>;
+
+private:
+    std::shared_ptr<const ChunkList> chunks = std::make_shared<const ChunkList>();
+    size_t length = 0;
+
+    static constexpr size_t MIN_CHUNK = 2 * 1024;
+    static constexpr size_t MAX_CHUNK = 64 * 1024;
+    static constexpr int BOUNDARY_BITS = 13;  // about 8 KB past the minimum
+    static constexpr size_t SEGMENT = 4 * 1024 * 1024;  // cut independently, in parallel
+
+    static const uint64_t* gearTable() {
+        static const std::vector<uint64_t> table = []() {
+            std::vector<uint64_t> values(256);
+            uint64_t state = 0x9E3779B97F4A7C15ULL;
+            for (auto &value : values) {
+                uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                value = z ^ (z >> 31);
+            }
+            return values;
+        }();
+        return table.data();
+    }
+
+    // Length of the chunk starting at p.
+    static size_t cut(const char* p, size_t len) {
+        if (len <= MIN_CHUNK) {
+            return len;
+        }
+        const uint64_t* gear = gearTable();
+        size_t limit = std::min(len, MAX_CHUNK);
+        uint64_t h = 0;
+        for (size_t i = MIN_CHUNK - 64; i < limit; i++) {
+            h = (h << 1) + gear[static_cast<unsigned char>(p[i])];
+            if (i >= MIN_CHUNK && (h >> (64 - BOUNDARY_BITS)) == 0) {
+                return i;
+            }
+        }
+        return limit;
+    }
+
+    static void cutInto(ChunkList& out, const char* p, size_t len) {
+        size_t segments = (len + SEGMENT - 1) / SEGMENT;
+        std::vector<ChunkList> parts(segments);
+        parallelFor(segments, [&](size_t s) {
+            const char* segment = p + s * SEGMENT;
+            size_t segmentLength = std::min(SEGMENT, len - s * SEGMENT);
+            for (size_t at = 0; at < segmentLength;) {
+                size_t n = cut(segment + at, segmentLength - at);
+                parts[s].push_back(ChunkStore::shared().intern(segment + at, n, hashBytes(segment + at, n)));
+                at += n;
+            }
+        });
+        for (auto &part : parts) {
+            out.insert(out.end(), part.begin(), part.end());
+        }
+    }
+
+    // Calls visit(piece, pieceLength) for the pieces of [from, from + len) in
+    // order while it returns true.
+    template <typename Visit>
+    void visit(size_t from, size_t len, Visit visitPiece) const {
+        size_t start = 0;
+        for (auto &chunk : *chunks) {
+            size_t end = start + chunk->size();
+            if (len == 0) {
+                return;
+            }
+            if (from < end) {
+                size_t n = std::min(len, end - from);
+                if (!visitPiece(chunk->data() + (from - start), n)) {
+                    return;
+                }
+                from += n;
+                len -= n;
+            }
+            start = end;
+        }
+    }
+
+public:
+    // Cuts text into stored chunks. Chunks of base that still match the text
+    // at the same distance from its start or end are taken over without
+    // cutting or hashing, so a snapshot after a small edit costs about one
+    // compare of the text.
+    static ChunkedText store(const char* text, size_t len, const ChunkedText* base = nullptr) {
+        ChunkList pieces;
+        size_t front = 0;
+        size_t prefix = 0;
+        size_t back = 0;
+        size_t suffix = 0;
+        if (base) {
+            const ChunkList& old = *base->chunks;
+            while (front < old.size() && prefix + old[front]->size() <= len
+                   && std::memcmp(text + prefix, old[front]->data(), old[front]->size()) == 0) {
+                prefix += old[front++]->size();
+            }
+            while (back < old.size() - front && prefix + suffix + old[old.size() - 1 - back]->size() <= len) {
+                const std::string& chunk = *old[old.size() - 1 - back];
+                if (std::memcmp(text + len - suffix - chunk.size(), chunk.data(), chunk.size()) != 0) {
+                    break;
+                }
+                suffix += chunk.size();
+                back++;
+            }
+            pieces.assign(old.begin(), old.begin() + front);
+        }
+        cutInto(pieces, text + prefix, len - prefix - suffix);
+        if (base) {
+            pieces.insert(pieces.end(), base->chunks->end() - back, base->chunks->end());
+        }
+        ChunkedText result;
+        result.chunks = std::make_shared<const ChunkList>(std::move(pieces));
+        result.length = len;
+        return result;
+    }
+
+    // The text after edits to base, given the changed ranges of the text and
+    // the number of bytes at its end that still equal the end of base; the
+    // rest, outside the ranges, equals base at the same offsets. Chunks of
+    // base lying wholly in those equal stretches are taken over without a
+    // compare, so only the changed ranges and the chunks they cut into are
+    // cut and hashed again.
+    static ChunkedText patch(const ChunkedText& base, const char* text, size_t len,
+                             const std::vector<std::pair<size_t, size_t>>& changed, size_t unchangedTail) {
+        size_t tail = std::min({unchangedTail, len, base.length});
+        size_t tailStart = base.length - tail;  // in base; it is at len - tail in the text
+        ChunkList pieces;
+        size_t done = 0;  // bytes of text the pieces cover
+        size_t range = 0;
+        size_t start = 0;
+        for (auto &chunk : *base.chunks) {
+            size_t end = start + chunk->size();
+            bool keep = false;
+            size_t at = start;
+            if (end <= len - tail) {
+                while (range < changed.size() && changed[range].second <= start) {
+                    range++;
+                }
+                keep = range == changed.size() || changed[range].first >= end;
+            } else if (start >= tailStart) {
+                keep = true;
+                at = start - tailStart + (len - tail);
+            }
+            if (keep && at >= done) {
+                cutInto(pieces, text + done, at - done);
+                pieces.push_back(chunk);
+                done = at + chunk->size();
+            }
+            start = end;
+        }
+        cutInto(pieces, text + done, len - done);
+        ChunkedText result;
+        result.chunks = std::make_shared<const ChunkList>(std::move(pieces));
+        result.length = len;
+        return result;
+    }
+
+    // The text made of the given stored chunks, in order.
+    static ChunkedText fromChunks(ChunkList list) {
+        ChunkedText result;
+        for (auto &chunk : list) {
+            result.length += chunk->size();
+        }
+        result.chunks = std::make_shared<const ChunkList>(std::move(list));
+        return result;
+    }
+
+    const ChunkList& chunkList() const {
+        return *chunks;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    std::string str() const {
+        std::string text;
+        text.reserve(length);
+        visit(0, length, [&](const char* piece, size_t n) {
+            text.append(piece, n);
+            return true;
+        });
+        return text;
+    }
+
+    void copyTo(size_t from, size_t len, char* out) const {
+        visit(from, len, [&](const char* piece, size_t n) {
+            std::memcpy(out, piece, n);
+            out += n;
+            return true;
+        });
+    }
+
+    // Number of bytes from offset on that equal text, up to len.
+    size_t matchAt(size_t offset, const char* text, size_t len) const {
+        size_t matched = 0;
+        visit(offset, std::min(len, length - std::min(offset, length)), [&](const char* piece, size_t n) {
+            size_t same = commonPrefix(piece, text + matched, n);
+            matched += same;
+            return same == n;
+        });
+        return matched;
+    }
+
+    // Number of trailing bytes that equal the bytes before textEnd, up to len.
+    size_t matchSuffix(const char* textEnd, size_t len) const {
+        const ChunkList& list = *chunks;
+        size_t matched = 0;
+        for (size_t i = list.size(); i-- > 0 && matched < len;) {
+            size_t n = std::min(list[i]->size(), len - matched);
+            size_t same = commonSuffix(list[i]->data() + list[i]->size(), textEnd - matched, n);
+            matched += same;
+            if (same < n) {
+                break;
+            }
+        }
+        return matched;
+    }
+};
+
+// Fixed set of worker threads fed from a queue, so chunk processing can run
+// while the next I/O requests are still in flight.
+class WorkerPool {
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable taskReady;
+    std::condition_variable allDone;
+    size_t pending = 0;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                taskReady.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) {
+                allDone.notify_all();
+            }
+        }
+    }
+
+public:
+    WorkerPool() {
+        size_t count = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < count; i++) {
+            threads.emplace_back([this]() { run(); });
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+        pending++;
+        taskReady.notify_one();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        allDone.wait(lock, [this]() { return pending == 0; });
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskReady.notify_all();
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+};
+
+#ifdef HAVE_IO_URING
+// Minimal io_uring wrapper over the raw system calls (no liburing needed).
+class IoUring {
+private:
+    int ringFd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+    unsigned toSubmit = 0;
+
+public:
+    unsigned entries = 0;
+
+    bool init(unsigned depth) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, depth, &params);
+        if (ringFd < 0) {
+            return false;
+        }
+        entries = params.sq_entries;
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            return false;
+        }
+        if (singleMap) {
+            cqRing = sqRing;
+        } else {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) {
+                return false;
+            }
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        char* sq = static_cast<char*>(sqRing);
+        char* cq = static_cast<char*>(cqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Queues a read or write; returns false if the submission queue is full.
+    bool push(bool write, int fd, char* buffer, size_t len, size_t offset, uint64_t userData) {
+        unsigned tail = *sqTail;
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries) {
+            return false;
+        }
+        unsigned slot = tail & *sqMask;
+        io_uring_sqe* sqe = &sqes[slot];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(buffer);
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = userData;
+        sqArray[slot] = slot;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        toSubmit++;
+        return true;
+    }
+
+    // Submits everything queued and waits for at least one completion.
+    bool submitAndWait() {
+        while (true) {
+            long done = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (done >= 0) {
+                toSubmit -= done;
+                return true;
+            }
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    // Entries pushed but not yet handed to the kernel.
+    unsigned queued() const {
+        return toSubmit;
+    }
+
+    // Waits for count submitted requests to complete, dropping their results,
+    // so the buffers they use can be released.
+    void drain(size_t count) {
+        uint64_t userData;
+        int result;
+        while (count > 0) {
+            if (pop(userData, result)) {
+                count--;
+                continue;
+            }
+            if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+                usleep(1000);
+            }
+        }
+    }
+
+    bool pop(uint64_t& userData, int& result) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        io_uring_cqe* cqe = &cqes[head & *cqMask];
+        userData = cqe->user_data;
+        result = cqe->res;
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    ~IoUring() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+        if (ringFd >= 0) {
+            close(ringFd);
+        }
+    }
+};
+#endif
+
+// Chunked file I/O. Many large requests are kept in flight through io_uring
+// when the kernel supports it, otherwise a thread pool issues pread/pwrite.
+// onChunk(i, begin, end) runs on worker threads as soon as chunk i is done.
+class FileIO {
+public:
+    enum Backend { AUTO, IO_URING, THREAD_POOL };
+    typedef std::function<void(size_t, size_t, size_t)> ChunkCallback;
+
+    static constexpr size_t CHUNK_SIZE = 4 * 1024 * 1024;
+    static constexpr unsigned QUEUE_DEPTH = 32;
+
+    static bool transfer(bool write, int fd, char* buffer, size_t size, const ChunkCallback& onChunk, Backend backend = AUTO) {
+#ifdef HAVE_IO_URING
+        if (backend != THREAD_POOL) {
+            int result = transferIoUring(write, fd, buffer, size, onChunk);
+            if (result >= 0 || backend == IO_URING) {
+                return result > 0;
+            }
+        }
+#else
+        if (backend == IO_URING) {
+            return false;
+        }
+#endif
+        return transferThreadPool(write, fd, buffer, size, onChunk);
+    }
+
+private:
+    static size_t chunkCount(size_t size) {
+        return (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    }
+
+    // Transfers bytes [begin, end) of the file to or from the same offsets in buffer.
+    static bool transferRange(bool write, int fd, char* buffer, size_t begin, size_t end) {
+        while (begin < end) {
+            ssize_t got = write ? pwrite(fd, buffer + begin, end - begin, begin)
+                                : pread(fd, buffer + begin, end - begin, begin);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            begin += got;
+        }
+        return true;
+    }
+
+    static bool transferThreadPool(bool write, int fd, char* buffer, size_t size, const ChunkCallback& onChunk) {
+        std::atomic<bool> failed(false);
+        parallelFor(chunkCount(size), [&](size_t i) {
+            size_t begin = i * CHUNK_SIZE;
+            size_t end = std::min(size, begin + CHUNK_SIZE);
+            if (!transferRange(write, fd, buffer, begin, end)) {
+                failed = true;
+                return;
+            }
+            onChunk(i, begin, end);
+        });
+        return !failed;
+    }
+
+#ifdef HAVE_IO_URING
+    // Returns 1 on success, 0 on an I/O error and -1 if io_uring is unusable
+    // before anything was transferred.
+    static int transferIoUring(bool write, int fd, char* buffer, size_t size, const ChunkCallback& onChunk) {
+        IoUring ring;
+        if (!ring.init(QUEUE_DEPTH)) {
+            return -1;
+        }
+        size_t chunks = chunkCount(size);
+        std::vector<size_t> done(chunks);
+        for (size_t i = 0; i < chunks; i++) {
+            done[i] = i * CHUNK_SIZE;
+        }
+        WorkerPool workers;
+        size_t next = 0;
+        size_t inFlight = 0;
+        size_t completed = 0;
+        bool anyCompleted = false;
+        bool failed = false;
+        // Queues the rest of chunk i; if the submission queue is full, it is
+        // transferred here instead.
+        auto queue = [&](size_t i) {
+            size_t begin = i * CHUNK_SIZE;
+            size_t end = std::min(size, begin + CHUNK_SIZE);
+            if (ring.push(write, fd, buffer + done[i], end - done[i], done[i], i)) {
+                inFlight++;
+                return;
+            }
+            if (!transferRange(write, fd, buffer, done[i], end)) {
+                failed = true;
+                return;
+            }
+            anyCompleted = true;
+            done[i] = end;
+            completed++;
+            workers.submit([&onChunk, i, begin, end]() { onChunk(i, begin, end); });
+        };
+        while (inFlight > 0 || (!failed && completed < chunks)) {
+            while (!failed && next < chunks && inFlight < ring.entries) {
+                queue(next++);
+            }
+            if (inFlight == 0) {
+                continue;
+            }
+            if (!ring.submitAndWait()) {
+                // Submitted requests still target buffer, so they must finish first.
+                ring.drain(inFlight - ring.queued());
+                workers.wait();
+                return anyCompleted ? 0 : -1;
+            }
+            uint64_t i;
+            int result;
+            while (ring.pop(i, result)) {
+                inFlight--;
+                if (result == -EINTR || result == -EAGAIN) {
+                    result = 0;
+                } else if (result <= 0) {
+                    // Let the requests still in flight finish before the buffer can go away.
+                    failed = true;
+                }
+                if (failed) {
+                    continue;
+                }
+                anyCompleted = true;
+                done[i] += result;
+                size_t begin = i * CHUNK_SIZE;
+                size_t end = std::min(size, begin + CHUNK_SIZE);
+                if (done[i] < end) {
+                    queue(i);
+                    continue;
+                }
+                completed++;
+                workers.submit([&onChunk, i, begin, end]() { onChunk(i, begin, end); });
+            }
+        }
+        workers.wait();
+        if (failed) {
+            return anyCompleted ? 0 : -1;
+        }
+        return 1;
+    }
+#endif
+};
+
+// Small LZ77 codec (LZ4-style sequences) for compressed files. Compressed
+// files are a magic number followed by independent frames, one per
+// CHUNK_SIZE bytes of text, so chunks can be (de)compressed in parallel.
+// A frame is the raw length, the stored length and the payload; a payload
+// as long as the raw data is stored uncompressed.
+class LzCodec {
+public:
+    static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+    static constexpr size_t HEADER_SIZE = 4;
+    static constexpr size_t FRAME_HEADER_SIZE = 8;
+
+    static const char* magic() {
+        return "LZC1";
+    }
+
+    static void compressFrame(const char* src, size_t len, std::string& out) {
+        out.assign(FRAME_HEADER_SIZE, '\0');
+        compress(src, len, out);
+        uint32_t rawLen = len;
+        uint32_t storedLen = out.size() - FRAME_HEADER_SIZE;
+        if (storedLen >= rawLen) {
+            out.replace(FRAME_HEADER_SIZE, std::string::npos, src, len);
+            storedLen = rawLen;
+        }
+        std::memcpy(&out[0], &rawLen, 4);
+        std::memcpy(&out[4], &storedLen, 4);
+    }
+
+    static bool decompressFrame(const char* src, size_t storedLen, char* dst, size_t rawLen) {
+        if (storedLen == rawLen) {
+            std::memcpy(dst, src, rawLen);
+            return true;
+        }
+        return decompress(src, storedLen, dst, rawLen);
+    }
+
+private:
+    static constexpr int HASH_BITS = 14;
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t MAX_OFFSET = 65535;
+
+    static void writeLength(std::string& out, size_t len) {
+        for (; len >= 255; len -= 255) {
+            out += static_cast<char>(255);
+        }
+        out += static_cast<char>(len);
+    }
+
+    static bool readLength(const unsigned char* src, size_t len, size_t& in, size_t& value) {
+        unsigned char byte;
+        do {
+            if (in >= len) {
+                return false;
+            }
+            byte = src[in++];
+            value += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    // Emits literals followed by a match; matchLen 0 marks the final literals.
+    static void writeSequence(std::string& out, const char* literals, size_t literalLen, size_t offset, size_t matchLen) {
+        size_t matchCode = matchLen ? matchLen - MIN_MATCH : 0;
+        out += static_cast<char>((std::min<size_t>(literalLen, 15) << 4) | std::min<size_t>(matchCode, 15));
+        if (literalLen >= 15) {
+            writeLength(out, literalLen - 15);
+        }
+        out.append(literals, literalLen);
+        if (matchLen == 0) {
+            return;
+        }
+        out += static_cast<char>(offset & 0xFF);
+        out += static_cast<char>(offset >> 8);
+        if (matchCode >= 15) {
+            writeLength(out, matchCode - 15);
+        }
+    }
+
+    static void compress(const char* src, size_t len, std::string& out) {
+        std::vector<uint32_t> table(1 << HASH_BITS, 0);  // position + 1, 0 when empty
+        size_t anchor = 0;
+        size_t pos = 0;
+        while (pos + MIN_MATCH <= len) {
+            uint32_t sequence;
+            std::memcpy(&sequence, src + pos, 4);
+            uint32_t slot = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            size_t candidate = table[slot];
+            table[slot] = pos + 1;
+            if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET || std::memcmp(src + candidate - 1, src + pos, 4) != 0) {
+                pos++;
+                continue;
+            }
+            candidate--;
+            size_t matchLen = MIN_MATCH;
+            while (pos + matchLen < len && src[candidate + matchLen] == src[pos + matchLen]) {
+                matchLen++;
+            }
+            writeSequence(out, src + anchor, pos - anchor, pos - candidate, matchLen);
+            pos += matchLen;
+            anchor = pos;
+        }
+        writeSequence(out, src + anchor, len - anchor, 0, 0);
+    }
+
+    static bool decompress(const char* source, size_t len, char* dst, size_t rawLen) {
+        auto src = reinterpret_cast<const unsigned char*>(source);
+        size_t in = 0;
+        size_t out = 0;
+        while (in < len) {
+            unsigned char token = src[in++];
+            size_t literalLen = token >> 4;
+            if (literalLen == 15 && !readLength(src, len, in, literalLen)) {
+                return false;
+            }
+            if (literalLen > len - in || literalLen > rawLen - out) {
+                return false;
+            }
+            std::memcpy(dst + out, src + in, literalLen);
+            in += literalLen;
+            out += literalLen;
+            if (in == len) {
+                break;
+            }
+            if (len - in < 2) {
+                return false;
+            }
+            size_t offset = src[in] | (src[in + 1] << 8);
+            in += 2;
+            size_t matchLen = token & 15;
+            if (matchLen == 15 && !readLength(src, len, in, matchLen)) {
+                return false;
+            }
+            matchLen += MIN_MATCH;
+            if (offset == 0 || offset > out || matchLen > rawLen - out) {
+                return false;
+            }
+            for (size_t i = 0; i < matchLen; i++, out++) {
+                dst[out] = dst[out - offset];
+            }
+        }
+        return out == rawLen;
+    }
+};
+
+class FenwickTree {
+private:
+    std::vector<size_t> tree;
+
+public:
+    template <typename Item, typename Field>
+    void build(const std::vector<Item>& items, Field Item::*field) {
+        tree.assign(items.size() + 1, 0);
+        for (size_t i = 1; i <= items.size(); i++) {
+            tree[i] += items[i - 1].*field;
+            size_t parent = i + (i & (~i + 1));
+            if (parent <= items.size()) {
+                tree[parent] += tree[i];
+            }
+        }
+    }
+
+    void update(size_t i, size_t oldValue, size_t newValue) {
+        for (i++; i < tree.size(); i += i & (~i + 1)) {
+            tree[i] = tree[i] - oldValue + newValue;
+        }
+    }
+
+    // Sum of the first count items.
+    size_t prefix(size_t count) const {
+        size_t sum = 0;
+        for (; count > 0; count -= count & (~count + 1)) {
+            sum += tree[count];
+        }
+        return sum;
+    }
+
+    // Index of the item in which the running sum first exceeds target;
+    // the sum of the items before it is stored in before.
+    size_t find(size_t target, size_t& before) const {
+        size_t pos = 0;
+        size_t step = 1;
+        while (step * 2 < tree.size()) {
+            step *= 2;
+        }
+        before = 0;
+        for (; step > 0; step /= 2) {
+            if (pos + step < tree.size() && before + tree[pos + step] <= target) {
+                pos += step;
+                before += tree[pos];
+            }
+        }
+        return pos;
+    }
+};
+
+// Balance of one bracket type over a stretch of text: opens minus closes,
+// and the lowest running balance reading from the left (counting the empty
+// prefix, so it is at most 0). The highest balance of any suffix is
+// sum - minPrefix.
+struct BracketBalance {
+    long sum;
+    long minPrefix;
+};
+
+struct BracketSummary {
+    static constexpr int TYPES = 3;
+    BracketBalance types[TYPES];
+
+    void append(const BracketSummary& right) {
+        for (int t = 0; t < TYPES; t++) {
+            types[t].minPrefix = std::min(types[t].minPrefix, types[t].sum + right.types[t].minPrefix);
+            types[t].sum += right.types[t].sum;
+        }
+    }
+};
+
+// Bracket type of c, with +1 in delta for an opener and -1 for a closer;
+// -1 when c is not a bracket.
+inline int bracketType(char c, int& delta) {
+    static const char opens[] = "([{";
+    static const char closes[] = ")]}";
+    for (int t = 0; t < BracketSummary::TYPES; t++) {
+        if (c == opens[t] || c == closes[t]) {
+            delta = c == opens[t] ? 1 : -1;
+            return t;
+        }
+    }
+    return -1;
+}
+
+#ifdef __SSE2__
+// Bit i is set when byte i of the 16 at p is a bracket.
+inline int bracketMask(const char* p) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i round = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('(')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8(')')));
+    __m128i square = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('[')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8(']')));
+    __m128i curly = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('{')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('}')));
+    return _mm_movemask_epi8(_mm_or_si128(round, _mm_or_si128(square, curly)));
+}
+#endif
+
+BracketSummary summarizeBrackets(const char* data, size_t begin, size_t end) {
+    BracketSummary summary = {};
+    auto visit = [&](char c) {
+        int delta = 0;
+        int t = bracketType(c, delta);
+        if (t >= 0) {
+            summary.types[t].sum += delta;
+            summary.types[t].minPrefix = std::min(summary.types[t].minPrefix, summary.types[t].sum);
+        }
+    };
+    size_t pos = begin;
+#ifdef __SSE2__
+    for (; pos + 16 <= end; pos += 16) {
+        for (int mask = bracketMask(data + pos); mask != 0; mask &= mask - 1) {
+            visit(data[pos + __builtin_ctz(mask)]);
+        }
+    }
+#endif
+    for (; pos < end; pos++) {
+        visit(data[pos]);
+    }
+    return summary;
+}
+
+// Segment tree of per-block bracket summaries. Finds the first block where
+// a running balance drops to a target, or the last block where a balance
+// read right to left rises to one, in O(log n).
+class BracketTree {
+private:
+    size_t leaves = 0;
+    std::vector<BracketSummary> nodes;
+
+    size_t findDrop(size_t node, size_t lo, size_t hi, size_t from, int type, long target, long& balance) const {
+        if (hi <= from) {
+            return SIZE_MAX;
+        }
+        const BracketBalance& here = nodes[node].types[type];
+        if (lo >= from && balance + here.minPrefix > target) {
+            balance += here.sum;
+            return SIZE_MAX;
+        }
+        if (hi - lo == 1) {
+            return lo;
+        }
+        size_t mid = (lo + hi) / 2;
+        size_t found = findDrop(2 * node, lo, mid, from, type, target, balance);
+        return found != SIZE_MAX ? found : findDrop(2 * node + 1, mid, hi, from, type, target, balance);
+    }
+
+    size_t findRise(size_t node, size_t lo, size_t hi, size_t before, int type, long target, long& balance) const {
+        if (lo >= before) {
+            return SIZE_MAX;
+        }
+        const BracketBalance& here = nodes[node].types[type];
+        if (hi <= before && balance + here.sum - here.minPrefix < target) {
+            balance += here.sum;
+            return SIZE_MAX;
+        }
+        if (hi - lo == 1) {
+            return lo;
+        }
+        size_t mid = (lo + hi) / 2;
+        size_t found = findRise(2 * node + 1, mid, hi, before, type, target, balance);
+        return found != SIZE_MAX ? found : findRise(2 * node, lo, mid, before, type, target, balance);
+    }
+
+public:
+    template <typename Item>
+    void build(const std::vector<Item>& items) {
+        leaves = 1;
+        while (leaves < items.size()) {
+            leaves *= 2;
+        }
+        nodes.assign(2 * leaves, BracketSummary());
+        for (size_t i = 0; i < items.size(); i++) {
+            nodes[leaves + i] = items[i].brackets;
+        }
+        for (size_t i = leaves - 1; i > 0; i--) {
+            nodes[i] = nodes[2 * i];
+            nodes[i].append(nodes[2 * i + 1]);
+        }
+    }
+
+    void update(size_t i, const BracketSummary& summary) {
+        i += leaves;
+        nodes[i] = summary;
+        for (i /= 2; i > 0; i /= 2) {
+            nodes[i] = nodes[2 * i];
+            nodes[i].append(nodes[2 * i + 1]);
+        }
+    }
+
+    // First block at or after from in which the balance of type, starting
+    // at balance, drops to -1; balance gets the balance before that block.
+    size_t firstDrop(size_t from, int type, long& balance) const {
+        return findDrop(1, 0, leaves, from, type, -1, balance);
+    }
+
+    // Last block before the given one in which the balance of type read
+    // right to left (opens count up), starting at balance, rises to 1;
+    // balance gets the balance after that block.
+    size_t lastRise(size_t before, int type, long& balance) const {
+        return findRise(1, 0, leaves, before, type, 1, balance);
+    }
+};
+
+struct TextBlock {
+    size_t length;
+    size_t newlines;
+    size_t codepoints;
+    size_t words;  // word starts inside the block
+    BracketSummary brackets;  // combined in order by BracketTree, not by add
+    uint64_t hash;  // hashBytes of the block's text; not combined by add
+
+    void add(const TextBlock& other) {
+        length += other.length;
+        newlines += other.newlines;
+        codepoints += other.codepoints;
+        words += other.words;
+    }
+
+    void subtract(const TextBlock& other) {
+        length -= other.length;
+        newlines -= other.newlines;
+        codepoints -= other.codepoints;
+        words -= other.words;
+    }
+};
+
+// Per-block summaries of the document, so line and character lookups cost
+// O(log n) plus one block instead of a scan from the start of the text.
+class TextIndex {
+private:
+    std::vector<TextBlock> blocks;
+    FenwickTree lengths;
+    FenwickTree newlines;
+    FenwickTree codepoints;
+    FenwickTree words;
+    BracketTree brackets;
+    TextBlock totals = {};
+
+    void rebuildTrees() {
+        totals = {};
+        for (auto &block : blocks) {
+            totals.add(block);
+        }
+        lengths.build(blocks, &TextBlock::length);
+        newlines.build(blocks, &TextBlock::newlines);
+        codepoints.build(blocks, &TextBlock::codepoints);
+        words.build(blocks, &TextBlock::words);
+        brackets.build(blocks);
+    }
+
+    void updateBlock(size_t i, const TextBlock& block) {
+        lengths.update(i, blocks[i].length, block.length);
+        newlines.update(i, blocks[i].newlines, block.newlines);
+        codepoints.update(i, blocks[i].codepoints, block.codepoints);
+        words.update(i, blocks[i].words, block.words);
+        brackets.update(i, block.brackets);
+        totals.subtract(blocks[i]);
+        totals.add(block);
+        blocks[i] = block;
+    }
+
+    // Block holding byte pos (the last block for pos == size); its first byte goes to start.
+    size_t blockAt(size_t pos, size_t& start) const {
+        size_t block = lengths.find(pos, start);
+        if (block == blocks.size() && block > 0) {
+            block--;
+            start -= blocks[block].length;
+        }
+        return block;
+    }
+
+public:
+    static constexpr size_t BLOCK_BYTES = 64 * 1024;
+
+    // A word starts at a non-separator that follows a separator or the start
+    // of the text. Without lookBehind, begin counts as the start of the text.
+    static TextBlock summarizeBlock(const char* data, size_t begin, size_t end, bool lookBehind = true) {
+        TextBlock block = {};
+        block.length = end - begin;
+        const char* p = data + begin;
+        const char* stop = data + end;
+        bool afterSeparator = !lookBehind || begin == 0 || isWordSeparator(data[begin - 1]);
+#ifdef __SSE2__
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i lastContinuation = _mm_set1_epi8(static_cast<char>(0xBF));
+        for (; p + 16 <= stop; p += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            block.newlines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)));
+            // Signed compare: only continuation bytes (0x80-0xBF) are <= 0xBF.
+            block.codepoints += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(bytes, lastContinuation)));
+            unsigned separators = separatorMask(p);
+            unsigned starts = ~separators & ((separators << 1) | afterSeparator) & 0xFFFF;
+            block.words += __builtin_popcount(starts);
+            afterSeparator = separators >> 15;
+        }
+#endif
+        for (; p < stop; p++) {
+            block.newlines += *p == '\n';
+            block.codepoints += !isContinuationByte(*p);
+            bool separator = isWordSeparator(*p);
+            block.words += afterSeparator && !separator;
+            afterSeparator = separator;
+        }
+        return block;
+    }
+
+    // Splits [begin, end) into blocks of at most maxBlock bytes.
+    static std::vector<TextBlock> summarize(const char* data, size_t begin, size_t end, size_t maxBlock = BLOCK_BYTES,
+                                            bool lookBehind = true) {
+        std::vector<TextBlock> result;
+        size_t len = end - begin;
+        if (len == 0) {
+            return result;
+        }
+        size_t count = (len + maxBlock - 1) / maxBlock;
+        for (size_t i = 0; i < count; i++) {
+            size_t from = begin + len * i / count;
+            size_t to = begin + len * (i + 1) / count;
+            result.push_back(summarizeBlock(data, from, to, lookBehind || i > 0));
+            result.back().brackets = summarizeBrackets(data, from, to);
+            result.back().hash = hashBytes(data + from, to - from);
+        }
+        return result;
+    }
+
+    // Summarizes one chunk of a file being loaded. Chunks are summarized
+    // concurrently, so the byte before the chunk may not have arrived yet;
+    // joinChunks settles the word starts at the chunk boundaries.
+    static std::vector<TextBlock> summarizeChunk(const char* data, size_t begin, size_t end) {
+        return summarize(data, begin, end, BLOCK_BYTES, false);
+    }
+
+    void joinChunks(const char* data, std::vector<std::vector<TextBlock>>& chunks, size_t chunkSize) {
+        std::vector<TextBlock> joined;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            size_t begin = i * chunkSize;
+            if (i > 0 && !chunks[i].empty() && !isWordSeparator(data[begin - 1]) && !isWordSeparator(data[begin])) {
+                chunks[i].front().words--;
+            }
+            joined.insert(joined.end(), chunks[i].begin(), chunks[i].end());
+        }
+        assign(std::move(joined));
+    }
+
+    // Index of the block holding byte pos (the last block for pos == size),
+    // with its first byte in start.
+    size_t blockOf(size_t pos, size_t& start) const {
+        return blockAt(pos, start);
+    }
+
+    const std::vector<TextBlock>& allBlocks() const {
+        return blocks;
+    }
+
+    void assign(std::vector<TextBlock> newBlocks) {
+        blocks = std::move(newBlocks);
+        rebuildTrees();
+    }
+
+    void build(const char* data, size_t size) {
+        assign(summarize(data, 0, size));
+    }
+
+    // Re-summarizes the blocks touched by replacing oldLen bytes at pos
+    // with newLen bytes. data and size describe the text after the edit.
+    void update(const char* data, size_t size, size_t pos, size_t oldLen, size_t newLen) {
+        size_t oldSize = size - newLen + oldLen;
+        if (blocks.empty() || oldSize == 0) {
+            build(data, size);
+            return;
+        }
+        size_t blockStart;
+        size_t first = blockAt(pos, blockStart);
+        size_t last = first;
+        size_t blockEnd = blockStart + blocks[first].length;
+        while (blockEnd < pos + oldLen) {
+            last++;
+            blockEnd += blocks[last].length;
+        }
+        // The first word start of the next block depends on the byte before it.
+        if (last + 1 < blocks.size()) {
+            last++;
+            blockEnd += blocks[last].length;
+        }
+        blockEnd = blockEnd + newLen - oldLen;
+
+        std::vector<TextBlock> replaced = summarize(data, blockStart, blockEnd, 2 * BLOCK_BYTES);
+        if (replaced.size() == last - first + 1) {
+            for (size_t i = 0; i < replaced.size(); i++) {
+                updateBlock(first + i, replaced[i]);
+            }
+        } else {
+            blocks.erase(blocks.begin() + first, blocks.begin() + last + 1);
+            blocks.insert(blocks.begin() + first, replaced.begin(), replaced.end());
+            rebuildTrees();
+        }
+    }
+
+    // First unmatched closer of the given bracket type at or after from, or
+    // SIZE_MAX. Scans the rest of the first block, lets the tree pick the
+    // block where the balance first goes negative, and scans that one.
+    size_t findClose(const char* data, size_t size, size_t from, int type) const {
+        if (from >= size) {
+            return SIZE_MAX;
+        }
+        size_t start;
+        size_t block = blockAt(from, start);
+        long balance = 0;
+        size_t end = start + blocks[block].length;
+        for (size_t pos = from; ; pos++) {
+            if (pos == end) {
+                block = brackets.firstDrop(block + 1, type, balance);
+                if (block >= blocks.size()) {
+                    return SIZE_MAX;
+                }
+                pos = lengths.prefix(block);
+                end = pos + blocks[block].length;
+            }
+            int delta = 0;
+            if (bracketType(data[pos], delta) == type && (balance += delta) < 0) {
+                return pos;
+            }
+        }
+    }
+
+    // Last unmatched opener of the given bracket type before the given
+    // position, or SIZE_MAX.
+    size_t findOpen(const char* data, size_t before, int type) const {
+        if (before == 0 || blocks.empty()) {
+            return SIZE_MAX;
+        }
+        size_t start;
+        size_t block = blockAt(before - 1, start);
+        long balance = 0;
+        for (size_t pos = before; ; ) {
+            if (pos == start) {
+                block = brackets.lastRise(block, type, balance);
+                if (block == SIZE_MAX) {
+                    return SIZE_MAX;
+                }
+                start = lengths.prefix(block);
+                pos = start + blocks[block].length;
+            }
+            pos--;
+            int delta = 0;
+            if (bracketType(data[pos], delta) == type && (balance += delta) > 0) {
+                return pos;
+            }
+        }
+    }
+
+    // Whole-document counts, kept up to date by every update.
+    const TextBlock& summary() const {
+        return totals;
+    }
+
+    size_t lineCount() const {
+        return totals.newlines + 1;
+    }
+
+    size_t charCount() const {
+        return totals.codepoints;
+    }
+
+    size_t wordCount() const {
+        return totals.words;
+    }
+
+    // Number of words starting before byte pos.
+    size_t wordsBefore(const char* data, size_t pos) const {
+        if (blocks.empty()) {
+            return 0;
+        }
+        size_t start;
+        size_t block = blockAt(pos, start);
+        return words.prefix(block) + summarizeBlock(data, start, pos).words;
+    }
+
+    // Byte offset where the given word starts, or size if there is no such word.
+    size_t wordStart(const char* data, size_t size, size_t word) const {
+        size_t before;
+        size_t block = words.find(word, before);
+        if (block >= blocks.size()) {
+            return size;
+        }
+        size_t pos = lengths.prefix(block);
+        bool afterSeparator = pos == 0 || isWordSeparator(data[pos - 1]);
+        for (size_t remaining = word - before; ; pos++) {
+            bool separator = isWordSeparator(data[pos]);
+            if (afterSeparator && !separator && remaining-- == 0) {
+                return pos;
+            }
+            afterSeparator = separator;
+        }
+    }
+
+    // Line holding byte pos.
+    size_t lineOf(const char* data, size_t pos) const {
+        if (blocks.empty()) {
+            return 0;
+        }
+        size_t start;
+        size_t block = blockAt(pos, start);
+        return newlines.prefix(block) + summarizeBlock(data, start, pos).newlines;
+    }
+
+    // Number of characters before byte pos.
+    size_t charOffset(const char* data, size_t pos) const {
+        if (blocks.empty()) {
+            return 0;
+        }
+        size_t start;
+        size_t block = blockAt(pos, start);
+        return codepoints.prefix(block) + summarizeBlock(data, start, pos).codepoints;
+    }
+
+    // Byte offset of the given character, or size if there is no such character.
+    size_t byteOffset(const char* data, size_t size, size_t charIndex) const {
+        size_t before;
+        size_t block = codepoints.find(charIndex, before);
+        if (block >= blocks.size()) {
+            return size;
+        }
+        size_t pos = lengths.prefix(block);
+        for (size_t remaining = charIndex - before; ; pos++) {
+            if (!isContinuationByte(data[pos]) && remaining-- == 0) {
+                return pos;
+            }
+        }
+    }
+
+    // Offset of the first byte of the given line, or size if there is no such line.
+    size_t lineStart(const char* data, size_t size, size_t line) const {
+        if (line == 0) {
+            return 0;
+        }
+        if (line >= lineCount()) {
+            return size;
+        }
+        size_t before;
+        size_t block = newlines.find(line - 1, before);
+        const char* p = data + lengths.prefix(block);
+        for (size_t remaining = line - before; ; remaining--) {
+            p = static_cast<const char*>(std::memchr(p, '\n', data + size - p)) + 1;
+            if (remaining == 1) {
+                return p - data;
+            }
+        }
+    }
+};
+
+enum class TokenKind {
+    Identifier,
+    Keyword,
+    Number,
+    String,
+    Comment,
+    Directive,
+    Punctuation,
+    Section,
+    Key,
+    Value
+};
+
+const char* tokenKindName(TokenKind kind) {
+    static const char* const names[] = {"identifier", "keyword", "number", "string", "comment",
+                                        "directive", "punctuation", "section", "key", "value"};
+    return names[static_cast<int>(kind)];
+}
+
+struct Token {
+    size_t pos;
+    size_t length;
+    TokenKind kind;
+};
+
+// Splits one line at a time. A lexer carries an int state from the end of
+// one line to the start of the next (0 at the start of the text), which is
+// what lets SyntaxIndex re-lex only the lines an edit can affect.
+class Lexer {
+public:
+    virtual ~Lexer() {}
+
+    // Lexes line (without its '\n') starting in state, appending tokens
+    // when tokens is not null, and returns the state the line ends in.
+    virtual int lexLine(const char* line, size_t length, int state, std::vector<Token>* tokens) const = 0;
+};
+
+// C, C++, Java and JavaScript style: comments, strings, numbers, keywords
+// and preprocessor lines, which may continue over lines ending in '\'.
+class CLikeLexer : public Lexer {
+private:
+    enum State {
+        NORMAL,
+        BLOCK_COMMENT,
+        DIRECTIVE
+    };
+
+    static bool isKeyword(std::string_view word) {
+        static const std::string_view keywords[] = {
+            "auto", "bool", "break", "case", "catch", "char", "class", "const", "constexpr", "continue",
+            "default", "delete", "do", "double", "else", "enum", "explicit", "export", "extends", "extern",
+            "false", "final", "float", "for", "function", "goto", "if", "import", "inline", "int",
+            "let", "long", "namespace", "new", "null", "nullptr", "operator", "override", "private", "protected",
+            "public", "return", "short", "signed", "sizeof", "static", "struct", "switch", "template", "this",
+            "throw", "true", "try", "typedef", "typename", "union", "unsigned", "using", "var", "virtual",
+            "void", "volatile", "while"};
+        return std::binary_search(std::begin(keywords), std::end(keywords), word);
+    }
+
+    static void add(std::vector<Token>* tokens, size_t pos, size_t length, TokenKind kind) {
+        if (tokens && length > 0) {
+            tokens->push_back({pos, length, kind});
+        }
+    }
+
+public:
+    int lexLine(const char* line, size_t length, int state, std::vector<Token>* tokens) const override {
+        std::string_view text(line, length);
+        size_t i = 0;
+        if (state == DIRECTIVE || (state == NORMAL && text.find_first_not_of(" \t") != std::string_view::npos
+                                   && text[text.find_first_not_of(" \t")] == '#')) {
+            size_t start = state == DIRECTIVE ? 0 : text.find_first_not_of(" \t");
+            add(tokens, start, length - start, TokenKind::Directive);
+            size_t last = text.find_last_not_of(" \t\r");
+            return last != std::string_view::npos && text[last] == '\\' ? DIRECTIVE : NORMAL;
+        }
+        if (state == BLOCK_COMMENT) {
+            size_t close = text.find("*/");
+            if (close == std::string_view::npos) {
+                add(tokens, 0, length, TokenKind::Comment);
+                return BLOCK_COMMENT;
+            }
+            add(tokens, 0, close + 2, TokenKind::Comment);
+            i = close + 2;
+        }
+        while (i < length) {
+            char c = line[i];
+            size_t start = i;
+            if (c == ' ' || c == '\t' || c == '\r') {
+                i++;
+            } else if (text.compare(i, 2, "//") == 0) {
+                add(tokens, i, length - i, TokenKind::Comment);
+                break;
+            } else if (text.compare(i, 2, "/*") == 0) {
+                size_t close = text.find("*/", i + 2);
+                if (close == std::string_view::npos) {
+                    add(tokens, i, length - i, TokenKind::Comment);
+                    return BLOCK_COMMENT;
+                }
+                i = close + 2;
+                add(tokens, start, i - start, TokenKind::Comment);
+            } else if (c == '"' || c == '\'') {
+                for (i++; i < length && line[i] != c; i++) {
+                    if (line[i] == '\\') {
+                        i++;
+                    }
+                }
+                i = std::min(i + 1, length);
+                add(tokens, start, i - start, TokenKind::String);
+            } else if (std::isdigit(static_cast<unsigned char>(c)) || (c == '.' && i + 1 < length && std::isdigit(static_cast<unsigned char>(line[i + 1])))) {
+                for (i++; i < length; i++) {
+                    char d = line[i];
+                    bool exponentSign = (d == '+' || d == '-') && std::strchr("eEpP", line[i - 1]);
+                    if (!std::isalnum(static_cast<unsigned char>(d)) && d != '.' && d != '\'' && d != '_' && !exponentSign) {
+                        break;
+                    }
+                }
+                add(tokens, start, i - start, TokenKind::Number);
+            } else if (std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '$') {
+                while (i < length && (std::isalnum(static_cast<unsigned char>(line[i])) || line[i] == '_' || line[i] == '$')) {
+                    i++;
+                }
+                add(tokens, start, i - start, isKeyword(text.substr(start, i - start)) ? TokenKind::Keyword : TokenKind::Identifier);
+            } else {
+                i++;
+                add(tokens, start, 1, TokenKind::Punctuation);
+            }
+        }
+        return NORMAL;
+    }
+};
+
+// INI and similar config files: [section], key = value and ; or # comments.
+// Every line stands alone, so the state is always 0.
+class IniLexer : public Lexer {
+public:
+    int lexLine(const char* line, size_t length, int, std::vector<Token>* tokens) const override {
+        if (!tokens) {
+            return 0;
+        }
+        std::string_view text(line, length);
+        size_t begin = text.find_first_not_of(" \t\r");
+        if (begin == std::string_view::npos) {
+            return 0;
+        }
+        size_t end = text.find_last_not_of(" \t\r") + 1;
+        if (text[begin] == ';' || text[begin] == '#') {
+            tokens->push_back({begin, end - begin, TokenKind::Comment});
+        } else if (text[begin] == '[') {
+            tokens->push_back({begin, end - begin, TokenKind::Section});
+        } else {
+            size_t separator = text.find_first_of("=:", begin);
+            if (separator == std::string_view::npos) {
+                tokens->push_back({begin, end - begin, TokenKind::Key});
+                return 0;
+            }
+            size_t keyEnd = text.find_last_not_of(" \t", separator - 1);
+            if (keyEnd != std::string_view::npos && keyEnd >= begin) {
+                tokens->push_back({begin, keyEnd + 1 - begin, TokenKind::Key});
+            }
+            tokens->push_back({separator, 1, TokenKind::Punctuation});
+            size_t value = text.find_first_not_of(" \t", separator + 1);
+            if (value != std::string_view::npos && value < end) {
+                tokens->push_back({value, end - value, TokenKind::Value});
+            }
+        }
+        return 0;
+    }
+};
+
+// The lexer state at the start of every line. An edit re-lexes from its
+// first line and stops at the first line after it whose start state comes
+// out unchanged, since everything below depends only on that state.
+class SyntaxIndex {
+private:
+    std::shared_ptr<const Lexer> lexer;  // lexers hold no state, so copies share them
+    std::vector<int> lineStates;
+
+    // Lexes from line (starting at byte pos) onwards, storing start states,
+    // until a line past settled keeps its old state.
+    void relex(const char* data, size_t size, size_t line, size_t pos, size_t settled) {
+        int state = lineStates[line];
+        while (line + 1 < lineStates.size()) {
+            auto end = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+            state = lexer->lexLine(data + pos, end - (data + pos), state, nullptr);
+            pos = end - data + 1;
+            line++;
+            if (line > settled && lineStates[line] == state) {
+                return;
+            }
+            lineStates[line] = state;
+        }
+    }
+
+public:
+    bool enabled() const {
+        return lexer != nullptr;
+    }
+
+    void setLexer(std::shared_ptr<const Lexer> newLexer, const char* data, size_t size, const TextIndex& index) {
+        lexer = std::move(newLexer);
+        rebuild(data, size, index);
+    }
+
+    void rebuild(const char* data, size_t size, const TextIndex& index) {
+        lineStates.clear();
+        if (lexer) {
+            lineStates.assign(index.lineCount(), 0);
+            relex(data, size, 0, 0, SIZE_MAX);
+        }
+    }
+
+    // Called after oldLen bytes at pos became newLen bytes and the text
+    // index was updated.
+    void update(const char* data, size_t size, const TextIndex& index, size_t pos, size_t newLen) {
+        if (!lexer) {
+            return;
+        }
+        size_t first = index.lineOf(data, pos);
+        size_t lastNew = index.lineOf(data, pos + newLen);
+        size_t lastOld = lastNew + lineStates.size() - index.lineCount();
+        lineStates.erase(lineStates.begin() + first + 1, lineStates.begin() + lastOld + 1);
+        lineStates.insert(lineStates.begin() + first + 1, lastNew - first, 0);
+        relex(data, size, first, index.lineStart(data, size, first), lastNew);
+    }
+
+    std::vector<Token> tokens(const char* data, size_t size, const TextIndex& index, size_t line) const {
+        std::vector<Token> tokens;
+        if (!lexer || line >= lineStates.size()) {
+            return tokens;
+        }
+        size_t start = index.lineStart(data, size, line);
+        auto end = static_cast<const char*>(std::memchr(data + start, '\n', size - start));
+        size_t length = end ? end - (data + start) : size - start;
+        lexer->lexLine(data + start, length, lineStates[line], &tokens);
+        for (auto &token : tokens) {
+            token.pos += start;
+        }
+        return tokens;
+    }
+};
+
+// Sorted, non-overlapping byte ranges changed since the last save, and the
+// number of bytes at the end of the text left untouched since then.
+class DirtyRanges {
+private:
+    std::vector<std::pair<size_t, size_t>> ranges;
+    size_t cleanTail = SIZE_MAX;
+
+    void mark(size_t begin, size_t end) {
+        if (begin >= end) {
+            return;
+        }
+        auto it = std::lower_bound(ranges.begin(), ranges.end(), std::make_pair(begin, begin));
+        if (it != ranges.begin() && (it - 1)->second >= begin) {
+            --it;
+        }
+        auto last = it;
+        while (last != ranges.end() && last->first <= end) {
+            begin = std::min(begin, last->first);
+            end = std::max(end, last->second);
+            ++last;
+        }
+        it = ranges.erase(it, last);
+        ranges.insert(it, std::make_pair(begin, end));
+    }
+
+public:
+    // Called after oldLen bytes at pos of a text of oldSize bytes became
+    // newLen bytes. If the length changed, everything after pos moved.
+    void markEdit(size_t pos, size_t oldLen, size_t newLen, size_t oldSize) {
+        if (oldLen == newLen) {
+            mark(pos, pos + newLen);
+        } else {
+            mark(pos, std::max(oldSize, oldSize - oldLen + newLen));
+        }
+        cleanTail = std::min(cleanTail, oldSize - pos - oldLen);
+    }
+
+    void markAll() {
+        mark(0, SIZE_MAX);
+        cleanTail = 0;
+    }
+
+    void clear() {
+        ranges.clear();
+        cleanTail = SIZE_MAX;
+    }
+
+    // Bytes at the end of the text that no edit has touched.
+    size_t untouchedTail() const {
+        return cleanTail;
+    }
+
+    bool empty() const {
+        return ranges.empty();
+    }
+
+    size_t totalBytes() const {
+        size_t total = 0;
+        for (auto &range : ranges) {
+            total += range.second - range.first;
+        }
+        return total;
+    }
+
+    const std::vector<std::pair<size_t, size_t>>& get() const {
+        return ranges;
+    }
+};
+
+// Identity of the file last loaded or saved, used to tell whether it is still
+// safe to patch it in place.
+struct DiskState {
+    bool valid = false;
+    std::string path;
+    size_t size = 0;
+    bool compressed = false;
+    dev_t device = 0;
+    ino_t inode = 0;
+    struct timespec mtime = {0, 0};
+
+    bool read(const std::string& filename) {
+        struct stat info;
+        valid = stat(filename.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+        compressed = false;
+        if (valid) {
+            path = filename;
+            size = info.st_size;
+            device = info.st_dev;
+            inode = info.st_ino;
+            mtime = info.st_mtim;
+        }
+        return valid;
+    }
+
+    bool sameAs(const DiskState& other) const {
+        return valid && other.valid && path == other.path && size == other.size && device == other.device
+               && inode == other.inode && mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec;
+    }
+};
+
+struct DiffHunk {
+    size_t oldStart;
+    size_t oldCount;
+    size_t newStart;
+    size_t newCount;
+};
+
+// Linear-space Myers diff (middle-snake bisection) of two sequences given
+// by an equality test on their indexes. Changed ranges are appended to
+// hunks in order, with adjacent ranges merged. Like GNU diff, the search
+// for a middle snake is capped at about the square root of the input size
+// (at least MIN_COST) edit steps; past that the range is reported as one
+// replacement, so mostly different inputs cost O(N * cap), not O(N * D).
+template <typename Equal>
+class MyersDiff {
+private:
+    Equal equal;
+    std::vector<DiffHunk>& hunks;
+    long costLimit;
+
+    static constexpr long MIN_COST = 4096;
+
+    void emit(size_t aBegin, size_t aEnd, size_t bBegin, size_t bEnd) {
+        if (aBegin == aEnd && bBegin == bEnd) {
+            return;
+        }
+        if (!hunks.empty()) {
+            DiffHunk& last = hunks.back();
+            if (last.oldStart + last.oldCount == aBegin && last.newStart + last.newCount == bBegin) {
+                last.oldCount += aEnd - aBegin;
+                last.newCount += bEnd - bBegin;
+                return;
+            }
+        }
+        hunks.push_back({aBegin, aEnd - aBegin, bBegin, bEnd - bBegin});
+    }
+
+    // Finds a point on an optimal edit path roughly halfway through it by
+    // running the search from both ends until the paths overlap.
+    void bisect(size_t aBegin, size_t aEnd, size_t bBegin, size_t bEnd, long& splitX, long& splitY) {
+        long n = aEnd - aBegin;
+        long m = bEnd - bBegin;
+        long maxD = std::min((n + m + 1) / 2, costLimit);
+        long offset = maxD;
+        long diagonals = 2 * maxD + 2;
+        std::vector<long> forward(diagonals, -1);
+        std::vector<long> backward(diagonals, -1);
+        forward[offset + 1] = 0;
+        backward[offset + 1] = 0;
+        long delta = n - m;
+        bool front = delta % 2 != 0;
+        long k1Start = 0, k1End = 0, k2Start = 0, k2End = 0;
+        for (long d = 0; d < maxD; d++) {
+            for (long k1 = -d + k1Start; k1 <= d - k1End; k1 += 2) {
+                long k1Offset = offset + k1;
+                long x1 = (k1 == -d || (k1 != d && forward[k1Offset - 1] < forward[k1Offset + 1]))
+                          ? forward[k1Offset + 1] : forward[k1Offset - 1] + 1;
+                long y1 = x1 - k1;
+                while (x1 < n && y1 < m && equal(aBegin + x1, bBegin + y1)) {
+                    x1++;
+                    y1++;
+                }
+                forward[k1Offset] = x1;
+                if (x1 > n) {
+                    k1End += 2;
+                } else if (y1 > m) {
+                    k1Start += 2;
+                } else if (front) {
+                    long k2Offset = offset + delta - k1;
+                    if (k2Offset >= 0 && k2Offset < diagonals && backward[k2Offset] != -1 && x1 >= n - backward[k2Offset]) {
+                        splitX = x1;
+                        splitY = y1;
+                        return;
+                    }
+                }
+            }
+            for (long k2 = -d + k2Start; k2 <= d - k2End; k2 += 2) {
+                long k2Offset = offset + k2;
+                long x2 = (k2 == -d || (k2 != d && backward[k2Offset - 1] < backward[k2Offset + 1]))
+                          ? backward[k2Offset + 1] : backward[k2Offset - 1] + 1;
+                long y2 = x2 - k2;
+                while (x2 < n && y2 < m && equal(aEnd - x2 - 1, bEnd - y2 - 1)) {
+                    x2++;
+                    y2++;
+                }
+                backward[k2Offset] = x2;
+                if (x2 > n) {
+                    k2End += 2;
+                } else if (y2 > m) {
+                    k2Start += 2;
+                } else if (!front) {
+                    long k1Offset = offset + delta - k2;
+                    if (k1Offset >= 0 && k1Offset < diagonals && forward[k1Offset] != -1) {
+                        long x1 = forward[k1Offset];
+                        if (x1 >= n - x2) {
+                            splitX = x1;
+                            splitY = x1 - (k1Offset - offset);
+                            return;
+                        }
+                    }
+                }
+            }
+        }
+        // No overlap within the cap: everything in a is replaced by
+        // everything in b.
+        splitX = n;
+        splitY = 0;
+    }
+
+public:
+    MyersDiff(Equal compare, std::vector<DiffHunk>& out, size_t total) : equal(compare), hunks(out), costLimit(MIN_COST) {
+        for (size_t rest = total; rest >= static_cast<size_t>(MIN_COST) * MIN_COST; rest >>= 2) {
+            costLimit <<= 1;
+        }
+    }
+
+    void run(size_t aBegin, size_t aEnd, size_t bBegin, size_t bEnd) {
+        while (aBegin < aEnd && bBegin < bEnd && equal(aBegin, bBegin)) {
+            aBegin++;
+            bBegin++;
+        }
+        while (aBegin < aEnd && bBegin < bEnd && equal(aEnd - 1, bEnd - 1)) {
+            aEnd--;
+            bEnd--;
+        }
+        if (aBegin == aEnd || bBegin == bEnd) {
+            emit(aBegin, aEnd, bBegin, bEnd);
+            return;
+        }
+        long x, y;
+        bisect(aBegin, aEnd, bBegin, bEnd, x, y);
+        if ((x == 0 && y == 0) || (x == static_cast<long>(aEnd - aBegin) && y == static_cast<long>(bEnd - bBegin))) {
+            x = aEnd - aBegin;
+            y = 0;
+        }
+        run(aBegin, aBegin + x, bBegin, bBegin + y);
+        run(aBegin + x, aEnd, bBegin + y, bEnd);
+    }
+};
+
+template <typename Equal>
+void myersDiff(size_t n, size_t m, Equal equal, std::vector<DiffHunk>& hunks) {
+    MyersDiff<Equal>(equal, hunks, n + m).run(0, n, 0, m);
+}
+
+// Byte-wise diff; hunk positions are byte offsets. The common prefix and
+// suffix are trimmed with SIMD compares before Myers runs on the rest.
+std::vector<DiffHunk> diffBytes(const char* a, size_t aSize, const char* b, size_t bSize) {
+    std::vector<DiffHunk> hunks;
+    size_t prefix = commonPrefix(a, b, std::min(aSize, bSize));
+    size_t suffix = commonSuffix(a + aSize, b + bSize, std::min(aSize, bSize) - prefix);
+    const char* aMiddle = a + prefix;
+    const char* bMiddle = b + prefix;
+    myersDiff(aSize - prefix - suffix, bSize - prefix - suffix,
+              [aMiddle, bMiddle](size_t i, size_t j) { return aMiddle[i] == bMiddle[j]; }, hunks);
+    for (auto &hunk : hunks) {
+        hunk.oldStart += prefix;
+        hunk.newStart += prefix;
+    }
+    return hunks;
+}
+
+// Line-wise diff of two texts; hunk positions are line numbers. Only the
+// lines between the common prefix and suffix (plus some context) are split
+// and compared, so a small change in a large text stays cheap.
+class LineDiff {
+private:
+    struct Side {
+        const char* text;
+        size_t size;
+        size_t firstLine;           // line number of the first line in starts
+        std::vector<size_t> starts; // line starts of the compared region, plus its end
+    };
+
+    Side a;
+    Side b;
+    std::vector<DiffHunk> changes;
+
+    static void splitLines(Side& side, size_t begin, size_t end) {
+        side.starts.clear();
+        for (size_t pos = begin; pos < end; ) {
+            side.starts.push_back(pos);
+            const void* newline = std::memchr(side.text + pos, '\n', end - pos);
+            pos = newline ? static_cast<const char*>(newline) - side.text + 1 : end;
+        }
+        side.starts.push_back(end);
+    }
+
+    std::string_view line(const Side& side, size_t i) const {
+        return std::string_view(side.text + side.starts[i], side.starts[i + 1] - side.starts[i]);
+    }
+
+    void printLine(std::ostream& out, char marker, const Side& side, size_t number) const {
+        std::string_view text = line(side, number - side.firstLine);
+        out << marker << text;
+        if (text.empty() || text.back() != '\n') {
+            out << "\n\\ No newline at end of file\n";
+        }
+    }
+
+public:
+    static constexpr size_t CONTEXT = 3;
+
+    // knownPrefix and knownSuffix are byte counts already known to be equal
+    // at the start and end of both texts; comparing starts past them.
+    // bIndex, when given, indexes bText and supplies the line number where
+    // the compared region starts instead of counting newlines up to it.
+    LineDiff(const char* aText, size_t aSize, const char* bText, size_t bSize, size_t knownPrefix = 0, size_t knownSuffix = 0,
+             const TextIndex* bIndex = nullptr) {
+        a.text = aText;
+        a.size = aSize;
+        b.text = bText;
+        b.size = bSize;
+
+        // Region start: back from the common prefix to a line start, then CONTEXT more lines.
+        size_t shorter = std::min(aSize, bSize);
+        size_t prefix = knownPrefix + commonPrefix(aText + knownPrefix, bText + knownPrefix, shorter - knownPrefix);
+        size_t begin = prefix;
+        for (size_t lines = 0; begin > 0 && lines <= CONTEXT; lines++) {
+            const void* newline = memrchr(aText, '\n', begin - 1);
+            begin = newline ? static_cast<const char*>(newline) - aText + 1 : 0;
+        }
+        // Region end: forward from the common suffix to a line start in both texts.
+        size_t known = std::min(knownSuffix, shorter - prefix);
+        size_t suffix = known + commonSuffix(aText + aSize - known, bText + bSize - known, shorter - prefix - known);
+        size_t aEnd = aSize - suffix;
+        size_t bEnd = bSize - suffix;
+        for (size_t lines = 0; aEnd < aSize && lines <= CONTEXT; lines++) {
+            bool atLineStart = (aEnd == begin || aText[aEnd - 1] == '\n') && (bEnd == begin || bText[bEnd - 1] == '\n');
+            if (atLineStart && lines == 0) {
+                continue;
+            }
+            const void* newline = std::memchr(aText + aEnd, '\n', aSize - aEnd);
+            size_t next = newline ? static_cast<const char*>(newline) - aText + 1 : aSize;
+            bEnd += next - aEnd;
+            aEnd = next;
+        }
+
+        // The region starts inside the common prefix, so both sides have the same lines before it.
+        a.firstLine = b.firstLine = bIndex ? bIndex->lineOf(bText, begin) : std::count(aText, aText + begin, '\n');
+        splitLines(a, begin, aEnd);
+        splitLines(b, begin, bEnd);
+
+        std::unordered_map<std::string_view, size_t> ids;
+        std::vector<size_t> aIds, bIds;
+        for (size_t i = 0; i + 1 < a.starts.size(); i++) {
+            aIds.push_back(ids.emplace(line(a, i), ids.size()).first->second);
+        }
+        for (size_t i = 0; i + 1 < b.starts.size(); i++) {
+            bIds.push_back(ids.emplace(line(b, i), ids.size()).first->second);
+        }
+        myersDiff(aIds.size(), bIds.size(), [&aIds, &bIds](size_t i, size_t j) { return aIds[i] == bIds[j]; }, changes);
+        for (auto &hunk : changes) {
+            hunk.oldStart += a.firstLine;
+            hunk.newStart += b.firstLine;
+        }
+    }
+
+    const std::vector<DiffHunk>& hunks() const {
+        return changes;
+    }
+
+    // Byte offset of a line on the old or new side; only lines inside the
+    // compared region (and the one just after it) are available.
+    size_t oldOffset(size_t line) const {
+        return a.starts[line - a.firstLine];
+    }
+
+    size_t newOffset(size_t line) const {
+        return b.starts[line - b.firstLine];
+    }
+
+    void printUnified(std::ostream& out, const std::string& oldName, const std::string& newName) const {
+        if (changes.empty()) {
+            out << "No changes." << std::endl;
+            return;
+        }
+        out << "--- " << oldName << "\n+++ " << newName << "\n";
+        size_t aLast = a.firstLine + a.starts.size() - 1;
+        for (size_t first = 0; first < changes.size(); ) {
+            size_t last = first;
+            while (last + 1 < changes.size()
+                   && changes[last + 1].oldStart - (changes[last].oldStart + changes[last].oldCount) <= 2 * CONTEXT) {
+                last++;
+            }
+            size_t oldFrom = std::max(a.firstLine, changes[first].oldStart - std::min(changes[first].oldStart, CONTEXT));
+            size_t oldTo = std::min(aLast, changes[last].oldStart + changes[last].oldCount + CONTEXT);
+            size_t newFrom = changes[first].newStart - (changes[first].oldStart - oldFrom);
+            size_t newTo = changes[last].newStart + changes[last].newCount + (oldTo - changes[last].oldStart - changes[last].oldCount);
+            out << "@@ -" << (oldTo > oldFrom ? oldFrom + 1 : oldFrom) << "," << oldTo - oldFrom
+                << " +" << (newTo > newFrom ? newFrom + 1 : newFrom) << "," << newTo - newFrom << " @@\n";
+            size_t oldLine = oldFrom;
+            for (size_t i = first; i <= last; i++) {
+                const DiffHunk& hunk = changes[i];
+                for (; oldLine < hunk.oldStart; oldLine++) {
+                    printLine(out, ' ', a, oldLine);
+                }
+                for (size_t j = 0; j < hunk.oldCount; j++) {
+                    printLine(out, '-', a, hunk.oldStart + j);
+                }
+                for (size_t j = 0; j < hunk.newCount; j++) {
+                    printLine(out, '+', b, hunk.newStart + j);
+                }
+                oldLine = hunk.oldStart + hunk.oldCount;
+            }
+            for (; oldLine < oldTo; oldLine++) {
+                printLine(out, ' ', a, oldLine);
+            }
+            first = last + 1;
+        }
+        out.flush();
+    }
+};
+
+// Replacement of oldLen bytes at pos by text.
+struct TextEdit {
+    size_t pos;
+    size_t oldLen;
+    std::string text;
+};
+
+// Edits composed over a text that stays untouched until the end. Pieces
+// either copy a range of the original or hold new text, so a sequence of
+// edits becomes one sorted list of TextEdits against the original.
+class EditComposer {
+private:
+    struct Piece {
+        bool original;
+        size_t from;  // offset in the original text
+        size_t length;
+        std::string text;
+    };
+
+    std::vector<Piece> pieces;
+    size_t originalSize;
+    size_t length;
+    size_t cursor = 0;       // a piece near the last edit
+    size_t cursorStart = 0;  // where that piece starts
+
+    // Index of the piece starting at pos, splitting the piece holding it.
+    // The walk starts from the cursor, since successive edits land close
+    // together, so a replay costs its runs and not runs times pieces.
+    size_t splitAt(size_t pos) {
+        while (cursor > 0 && cursorStart > pos) {
+            cursor--;
+            cursorStart -= pieces[cursor].length;
+        }
+        while (cursor < pieces.size() && cursorStart + pieces[cursor].length <= pos) {
+            cursorStart += pieces[cursor].length;
+            cursor++;
+        }
+        if (cursor == pieces.size() || cursorStart == pos) {
+            return cursor;
+        }
+        size_t head = pos - cursorStart;
+        Piece tail = pieces[cursor];
+        tail.from += head;
+        tail.length -= head;
+        pieces[cursor].length = head;
+        if (!tail.original) {
+            tail.text = pieces[cursor].text.substr(head);
+            pieces[cursor].text.resize(head);
+        }
+        pieces.insert(pieces.begin() + cursor + 1, tail);
+        return cursor + 1;
+    }
+
+public:
+    explicit EditComposer(size_t textSize) : originalSize(textSize), length(textSize) {
+        if (textSize > 0) {
+            pieces.push_back({true, 0, textSize, ""});
+        }
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    // Replaces oldLen bytes at pos of the composed text; false if the range
+    // is outside it.
+    bool apply(size_t pos, size_t oldLen, const std::string& text) {
+        if (pos > length || oldLen > length - pos) {
+            return false;
+        }
+        size_t first = splitAt(pos);
+        size_t last = splitAt(pos + oldLen);
+        pieces.erase(pieces.begin() + first, pieces.begin() + last);
+        if (!text.empty()) {
+            pieces.insert(pieces.begin() + first, {false, 0, text.size(), text});
+        }
+        // The piece before the edit keeps its start, even if merged into.
+        cursor = first > 0 ? first - 1 : 0;
+        cursorStart = first > 0 ? pos - pieces[first - 1].length : 0;
+        // Neighbouring new text is merged, so repeated runs keep the list short.
+        if (first > 0 && first < pieces.size() && !pieces[first - 1].original && !pieces[first].original) {
+            pieces[first - 1].text += pieces[first].text;
+            pieces[first - 1].length += pieces[first].length;
+            pieces.erase(pieces.begin() + first);
+        }
+        length = length - oldLen + text.size();
+        return true;
+    }
+
+    std::vector<TextEdit> edits() const {
+        std::vector<TextEdit> result;
+        size_t expected = 0;
+        std::string pending;
+        for (auto &piece : pieces) {
+            if (!piece.original) {
+                pending += piece.text;
+                continue;
+            }
+            if (piece.from > expected || !pending.empty()) {
+                result.push_back({expected, piece.from - expected, pending});
+                pending.clear();
+            }
+            expected = piece.from + piece.length;
+        }
+        if (expected < originalSize || !pending.empty()) {
+            result.push_back({expected, originalSize - expected, pending});
+        }
+        return result;
+    }
+};
+
+// One recorded edit. Positions are relative to the replay anchor, except
+// for appends, which always go to the end of the text.
+struct MacroStep {
+    bool atEnd;
+    long offset;
+    size_t oldLen;
+    std::string text;
+};
+
+// One hunk of a unified diff. Each line keeps its marker (' ', '-' or '+')
+// and its text, including the newline unless the patch says there is none.
+struct PatchHunk {
+    size_t oldStart;
+    size_t oldCount;
+    size_t newStart;
+    size_t newCount;
+    std::vector<std::pair<char, std::string>> lines;
+
+    std::string oldText() const {
+        std::string text;
+        for (auto &line : lines) {
+            if (line.first != '+') {
+                text += line.second;
+            }
+        }
+        return text;
+    }
+
+    std::string newText() const {
+        std::string text;
+        for (auto &line : lines) {
+            if (line.first != '-') {
+                text += line.second;
+            }
+        }
+        return text;
+    }
+};
+
+// Reads "start[,count]" from a hunk header, moving pos past it.
+bool parseHunkRange(const std::string& header, size_t& pos, size_t& start, size_t& count) {
+    size_t used;
+    try {
+        start = std::stoul(header.substr(pos), &used);
+        pos += used;
+        count = 1;
+        if (pos < header.size() && header[pos] == ',') {
+            pos++;
+            count = std::stoul(header.substr(pos), &used);
+            pos += used;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+// Parses the hunks of a single-file unified diff. Returns false (with a
+// message in error) when the patch is malformed.
+bool parseUnifiedDiff(const std::string& patch, std::vector<PatchHunk>& hunks, std::string& error) {
+    size_t pos = 0;
+    bool seenFile = false;
+    PatchHunk* hunk = nullptr;
+    size_t oldLeft = 0, newLeft = 0;
+    while (pos < patch.size()) {
+        size_t end = patch.find('\n', pos);
+        bool hasNewline = end != std::string::npos;
+        std::string line = patch.substr(pos, hasNewline ? end - pos : std::string::npos);
+        pos = hasNewline ? end + 1 : patch.size();
+
+        if (hunk && (oldLeft > 0 || newLeft > 0) && line.empty() && hasNewline) {
+            line = " ";  // some tools strip the space from empty context lines
+        }
+        if (hunk && (oldLeft > 0 || newLeft > 0) && !line.empty() && (line[0] == ' ' || line[0] == '-' || line[0] == '+')) {
+            size_t& left = line[0] == '+' ? newLeft : oldLeft;
+            if (left == 0 || (line[0] == ' ' && newLeft == 0)) {
+                error = "Hunk is longer than its header says.";
+                return false;
+            }
+            left--;
+            if (line[0] == ' ') {
+                newLeft--;
+            }
+            hunk->lines.push_back({line[0], line.substr(1) + "\n"});
+        } else if (hunk && !line.empty() && line[0] == '\\') {
+            if (hunk->lines.empty()) {
+                error = "Unexpected \"no newline\" marker.";
+                return false;
+            }
+            hunk->lines.back().second.pop_back();
+        } else if (line.compare(0, 3, "@@ ") == 0) {
+            if (hunk && (oldLeft > 0 || newLeft > 0)) {
+                error = "Hunk is shorter than its header says.";
+                return false;
+            }
+            PatchHunk next;
+            size_t at = 3;
+            if (line[at] != '-' || !parseHunkRange(line, ++at, next.oldStart, next.oldCount)
+                || line.compare(at, 2, " +") != 0 || !parseHunkRange(line, at += 2, next.newStart, next.newCount)) {
+                error = "Malformed hunk header: " + line;
+                return false;
+            }
+            hunks.push_back(next);
+            hunk = &hunks.back();
+            oldLeft = next.oldCount;
+            newLeft = next.newCount;
+        } else if (line.compare(0, 4, "--- ") == 0 && (!hunk || (oldLeft == 0 && newLeft == 0))) {
+            if (seenFile) {
+                error = "Patch changes more than one file.";
+                return false;
+            }
+            seenFile = true;
+        } else if (hunk && (oldLeft > 0 || newLeft > 0)) {
+            error = "Hunk is shorter than its header says.";
+            return false;
+        }
+    }
+    if (hunk && (oldLeft > 0 || newLeft > 0)) {
+        error = "Patch ends in the middle of a hunk.";
+        return false;
+    }
+    return true;
+}
+
+class Memento {
+    friend class DynamicArray;
+    friend class CareTaker;
+
+private:
+    ChunkedText savedText;
+    size_t savedCapacity;
+
+    Memento(ChunkedText text, size_t capacity)
+            : savedText(std::move(text)), savedCapacity(capacity) {
+    }
+};
+
+class CareTaker {
+private:
+    std::vector<Memento*> undoStack;
+    std::vector<Memento*> redoStack;
+
+    // Snapshots are stored against the newest one, which usually differs
+    // from the text by a single edit.
+    Memento* snapshot(const char* data, size_t size, size_t capacity) const {
+        const Memento* newest = !undoStack.empty() ? undoStack.back() : !redoStack.empty() ? redoStack.back() : nullptr;
+        return new Memento(ChunkedText::store(data, size, newest ? &newest->savedText : nullptr), capacity);
+    }
+
+public:
+    void saveState(const char* data, size_t size, size_t capacity) {
+        auto memento = snapshot(data, size, capacity);
+        undoStack.push_back(memento);
+
+        for (auto &memento : redoStack) {
+            delete memento;
+        }
+        redoStack.clear();
+    }
+
+    void pushToUndo(const char* data, size_t size, size_t capacity) {
+        auto memento = snapshot(data, size, capacity);
+        undoStack.push_back(memento);
+    }
+
+    void pushToRedo(const char* data, size_t size, size_t capacity) {
+        auto memento = snapshot(data, size, capacity);
+        redoStack.push_back(memento);
+    }
+
+    Memento* undo() {
+        if (!undoStack.empty()) {
+            auto memento = undoStack.back();
+            undoStack.pop_back();
+            return memento;
+        }
+        return nullptr;
+    }
+
+    // Snapshot depth steps back on the undo stack (1 is the most recent), or nullptr.
+    const Memento* peekUndo(size_t depth) const {
+        if (depth == 0 || depth > undoStack.size()) {
+            return nullptr;
+        }
+        return undoStack[undoStack.size() - depth];
+    }
+
+    const std::vector<Memento*>& undoStates() const {
+        return undoStack;
+    }
+
+    const std::vector<Memento*>& redoStates() const {
+        return redoStack;
+    }
+
+    // Makes the stacks copies of other's; the snapshots share their text.
+    void copyFrom(const CareTaker& other) {
+        auto copy = [](const std::vector<Memento*>& stack) {
+            std::vector<Memento*> result;
+            for (auto memento : stack) {
+                result.push_back(new Memento(*memento));
+            }
+            return result;
+        };
+        replaceStacks(copy(other.undoStack), copy(other.redoStack));
+    }
+
+    // Takes ownership of the given stacks in place of the current ones.
+    void replaceStacks(std::vector<Memento*> undo, std::vector<Memento*> redo) {
+        for (auto &memento : undoStack) {
+            delete memento;
+        }
+        for (auto &memento : redoStack) {
+            delete memento;
+        }
+        undoStack = std::move(undo);
+        redoStack = std::move(redo);
+    }
+
+    Memento* redo() {
+        if (!redoStack.empty()) {
+            auto memento = redoStack.back();
+            redoStack.pop_back();
+            return memento;
+        }
+        return nullptr;
+    }
+
+    ~CareTaker() {
+        for (auto &memento : undoStack) {
+            delete memento;
+        }
+        for (auto &memento : redoStack) {
+            delete memento;
+        }
+    }
+};
+
+// Fixed-size slots of one process-wide memfd, for text buffers to map.
+// Freed slots are punched out of the file, so they hold no memory, and
+// are handed out again lowest first, so a buffer's slots tend to be
+// neighbours that one mapping covers.
+class SlotFile {
+public:
+    static constexpr size_t SLOT_BYTES = 1 << 20;
+
+    // A slot, given back to the file when the last buffer holding it lets go.
+    struct Slot {
+        off_t offset;
+
+        explicit Slot(off_t at) : offset(at) {
+        }
+
+        Slot(const Slot&) = delete;
+        Slot& operator=(const Slot&) = delete;
+
+        ~Slot() {
+            SlotFile::shared().release(offset);
+        }
+    };
+
+private:
+    int fd = -1;
+    off_t end = 0;
+    std::set<off_t> freeSlots;
+    std::mutex mutex;
+
+    SlotFile() {
+        fd = memfd_create("editor-text", MFD_CLOEXEC);
+    }
+
+    void release(off_t offset) {
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, SLOT_BYTES);
+        std::lock_guard<std::mutex> lock(mutex);
+        freeSlots.insert(offset);
+    }
+
+public:
+    static SlotFile& shared() {
+        static SlotFile file;
+        return file;
+    }
+
+    // The memfd, or -1 where there is none.
+    int descriptor() const {
+        return fd;
+    }
+
+    // Appends count slots to slots; false if the file cannot grow.
+    bool take(size_t count, std::vector<std::shared_ptr<Slot>>& slots) {
+        std::vector<off_t> offsets;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (offsets.size() < count && !freeSlots.empty()) {
+                offsets.push_back(*freeSlots.begin());
+                freeSlots.erase(freeSlots.begin());
+            }
+            size_t fresh = count - offsets.size();
+            if (fresh > 0 && ftruncate(fd, end + fresh * SLOT_BYTES) != 0) {
+                freeSlots.insert(offsets.begin(), offsets.end());
+                return false;
+            }
+            for (; fresh > 0; fresh--) {
+                offsets.push_back(end);
+                end += SLOT_BYTES;
+            }
+        }
+        for (off_t offset : offsets) {
+            slots.push_back(std::make_shared<Slot>(offset));
+        }
+        return true;
+    }
+};
+
+// Memory for the text of a document: slots of the slot file mapped one
+// after another, so the text is contiguous. A buffer shared with a clone
+// maps the same slots, and a slot held by both is copied to a fresh one
+// before either writes to it, so an edit copies only the slots it writes.
+// Without a memfd the buffer is private memory, and sharing copies it.
+class TextBuffer {
+    friend class SelfCheck;
+
+private:
+    char* base = nullptr;
+    size_t mapped = 0;  // bytes of address space, whole slots
+    std::vector<std::shared_ptr<SlotFile::Slot>> slots;  // empty for private memory
+
+    static size_t slotsFor(size_t bytes) {
+        return std::max<size_t>(1, (bytes + SlotFile::SLOT_BYTES - 1) / SlotFile::SLOT_BYTES);
+    }
+
+    // Address space for count slots, mapped to nothing yet.
+    static char* reserve(size_t count) {
+        void* p = mmap(nullptr, count * SlotFile::SLOT_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        return static_cast<char*>(p);
+    }
+
+    // Maps slots [first, last) over the address space, a run of
+    // neighbouring slots at a time.
+    void mapSlots(size_t first, size_t last) {
+        int fd = SlotFile::shared().descriptor();
+        while (first < last) {
+            size_t run = 1;
+            while (first + run < last && slots[first + run]->offset == slots[first]->offset + off_t(run * SlotFile::SLOT_BYTES)) {
+                run++;
+            }
+            if (mmap(base + first * SlotFile::SLOT_BYTES, run * SlotFile::SLOT_BYTES, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, slots[first]->offset) == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            first += run;
+        }
+    }
+
+    // Writes [p, p + len) into the slot file at offset.
+    static bool store(const char* p, size_t len, off_t offset) {
+        int fd = SlotFile::shared().descriptor();
+        while (len > 0) {
+            ssize_t written = pwrite(fd, p, len, offset);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            p += written;
+            len -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    void unmap() {
+        if (base) {
+            munmap(base, mapped);
+        }
+        base = nullptr;
+        mapped = 0;
+        slots.clear();
+    }
+
+public:
+    TextBuffer() = default;
+
+    // At least bytes of memory, not shared with any other buffer.
+    explicit TextBuffer(size_t bytes) {
+        size_t count = slotsFor(bytes);
+        if (SlotFile::shared().descriptor() < 0 || !SlotFile::shared().take(count, slots)) {
+            void* p = mmap(nullptr, count * SlotFile::SLOT_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            base = static_cast<char*>(p);
+            mapped = count * SlotFile::SLOT_BYTES;
+            return;
+        }
+        base = reserve(count);
+        mapped = count * SlotFile::SLOT_BYTES;
+        mapSlots(0, count);
+    }
+
+    TextBuffer(TextBuffer&& other) noexcept
+            : base(other.base), mapped(other.mapped), slots(std::move(other.slots)) {
+        other.base = nullptr;
+        other.mapped = 0;
+        other.slots.clear();
+    }
+
+    TextBuffer& operator=(TextBuffer&& other) noexcept {
+        if (this != &other) {
+            unmap();
+            std::swap(base, other.base);
+            std::swap(mapped, other.mapped);
+            slots.swap(other.slots);
+        }
+        return *this;
+    }
+
+    ~TextBuffer() {
+        unmap();
+    }
+
+    char* data() const {
+        return base;
+    }
+
+    // A buffer with the same contents. It maps the same slots, so this
+    // costs a mapping per run of neighbouring slots and no copy.
+    TextBuffer share() const {
+        TextBuffer copy;
+        if (slots.empty()) {
+            copy = TextBuffer(mapped);
+            std::memcpy(copy.base, base, mapped);
+            return copy;
+        }
+        copy.base = reserve(slots.size());
+        copy.mapped = mapped;
+        copy.slots = slots;
+        copy.mapSlots(0, slots.size());
+        return copy;
+    }
+
+    // Makes room for at least bytes, keeping the contents. The slots held
+    // are mapped at a new address next to fresh ones; none is copied.
+    void grow(size_t bytes) {
+        size_t count = slotsFor(bytes);
+        if (count * SlotFile::SLOT_BYTES <= mapped) {
+            return;
+        }
+        if (slots.empty()) {
+            void* p = mremap(base, mapped, count * SlotFile::SLOT_BYTES, MREMAP_MAYMOVE);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            base = static_cast<char*>(p);
+            mapped = count * SlotFile::SLOT_BYTES;
+            return;
+        }
+        size_t held = slots.size();
+        if (!SlotFile::shared().take(count - held, slots)) {
+            slots.resize(held);
+            throw std::bad_alloc();
+        }
+        char* moved = reserve(count);
+        munmap(base, mapped);
+        base = moved;
+        mapped = count * SlotFile::SLOT_BYTES;
+        mapSlots(0, count);
+    }
+
+    // Gives this buffer its own copy of every shared slot in [begin, end),
+    // before they are written. Only the first keep bytes of the buffer
+    // hold anything, so only those are copied.
+    void own(size_t begin, size_t end, size_t keep) {
+        if (slots.empty() || begin >= end) {
+            return;
+        }
+        for (size_t i = begin / SlotFile::SLOT_BYTES; i < slots.size() && i * SlotFile::SLOT_BYTES < end; i++) {
+            if (slots[i].use_count() == 1) {
+                continue;
+            }
+            std::vector<std::shared_ptr<SlotFile::Slot>> fresh;
+            if (!SlotFile::shared().take(1, fresh)) {
+                throw std::bad_alloc();
+            }
+            size_t start = i * SlotFile::SLOT_BYTES;
+            size_t len = std::min(SlotFile::SLOT_BYTES, keep - std::min(keep, start));
+            if (!store(base + start, len, fresh[0]->offset)) {
+                throw std::bad_alloc();
+            }
+            slots[i] = fresh[0];
+            mapSlots(i, i + 1);
+        }
+    }
+};
+
+// A value that clones of a document share until one of them changes it.
+// Reads go through the shared value; edit() first makes a copy if another
+// document still holds it.
+template <typename T>
+class CopyOnWrite {
+private:
+    std::shared_ptr<T> value = std::make_shared<T>();
+
+public:
+    const T& operator*() const {
+        return *value;
+    }
+
+    const T* operator->() const {
+        return value.get();
+    }
+
+    T& edit() {
+        if (value.use_count() > 1) {
+            value = std::make_shared<T>(*value);
+        }
+        return *value;
+    }
+
+    // The value, to be overwritten whole: a new one rather than a copy if
+    // another document still holds it.
+    T& replace() {
+        if (value.use_count() > 1) {
+            value = std::make_shared<T>();
+        }
+        return *value;
+    }
+};
+
+class DynamicArray {
+    friend class SelfCheck;
+
+private:
+    char* data;
+    TextBuffer buffer;  // holds data, shared with clones slot by slot
+    size_t size;
+    size_t capacity;
+    CareTaker careTaker;
+    ChunkedText clipboard;
+    CopyOnWrite<TextIndex> textIndex;
+    CopyOnWrite<SearchCache> searchCache;
+    CopyOnWrite<SyntaxIndex> syntax;
+
+    bool knownUtf8 = true;      // the text is known to be valid UTF-8
+    ChunkedText diskText;       // text as last loaded or saved, for diffs
+    // Index blocks of diskText and the offset of each, then the end; set
+    // whole, so clones share them.
+    std::shared_ptr<const std::vector<TextBlock>> diskBlocks = std::make_shared<const std::vector<TextBlock>>();
+    std::shared_ptr<const std::vector<size_t>> diskStarts = std::make_shared<const std::vector<size_t>>(1, 0);
+    DiskState diskState;
+    DirtyRanges dirty;
+
+    bool useSidecar = false;
+    bool recording = false;
+    size_t macroAnchor = 0;  // where the next replay run starts once recording stops
+    size_t macroEnd = 0;     // end of what the recording touched
+    std::vector<MacroStep> macro;
+
+    static constexpr size_t PATCH_ALIGNMENT = 4096;
+    static constexpr long MAX_PATCH_DRIFT = 100;  // lines a hunk may have moved
+    static constexpr size_t LINE_BATCH = 64 * 1024;  // lines per parallel task
+    static constexpr size_t EDIT_CLUSTER_GAP = 4 * TextIndex::BLOCK_BYTES;  // closer edits share index updates
+    static constexpr char SESSION_MAGIC[] = "EDS3";
+    static constexpr char SIDECAR_MAGIC[] = "EDX4";
+
+    static_assert(FileIO::CHUNK_SIZE % TextIndex::BLOCK_BYTES == 0, "file chunks must hold whole index blocks");
+    static_assert(LzCodec::CHUNK_SIZE % TextIndex::BLOCK_BYTES == 0, "codec chunks must hold whole index blocks");
+
+    // Gives this document its own copy of the parts of [begin, end) it
+    // shares with clones, before they are changed in place.
+    void ownText(size_t begin, size_t end) {
+        buffer.own(begin, end, size + 1);
+    }
+
+    void resize(size_t newCapacity) {
+        buffer.grow(newCapacity);
+        data = buffer.data();
+        capacity = newCapacity;
+    }
+
+    // Keeps the indexes in step with a replacement of oldLen bytes at pos by newLen bytes.
+    void onEdit(size_t pos, size_t oldLen, size_t newLen) {
+        onEdit(data, size, pos, oldLen, newLen);
+    }
+
+    // The same for text and textSize standing in for the document, which
+    // need only be right from updateReach(pos) on; see applyEdits.
+    void onEdit(const char* text, size_t textSize, size_t pos, size_t oldLen, size_t newLen) {
+        textIndex.edit().update(text, textSize, pos, oldLen, newLen);
+        searchCache.edit().update(text, textSize, pos, oldLen, newLen);
+        syntax.edit().update(text, textSize, *textIndex, pos, newLen);
+        dirty.markEdit(pos, oldLen, newLen, textSize - newLen + oldLen);
+        knownUtf8 = knownUtf8 && validUtf8Around(text, textSize, pos, pos + newLen);
+    }
+
+    // First byte the updates in onEdit may read for an edit at pos: one
+    // before the start of its block, of the block where its line starts and
+    // of the longest cached pattern ending at pos.
+    size_t updateReach(size_t pos) const {
+        size_t reach;
+        textIndex->blockOf(pos, reach);
+        if (syntax->enabled()) {
+            size_t lineStart = textIndex->lineStart(data, size, textIndex->lineOf(data, pos));
+            size_t blockStart;
+            textIndex->blockOf(lineStart > 0 ? lineStart - 1 : 0, blockStart);
+            reach = std::min(reach, blockStart);
+        }
+        reach = std::min(reach, pos - std::min(pos, searchCache->longestPattern()));
+        return reach > 0 ? reach - 1 : 0;
+    }
+
+    // Switches to a snapshot, rewriting only the bytes between the common
+    // prefix and suffix, so the indexes see an edit the size of the change.
+    void restore(Memento* memento) {
+        size_t oldSize = size;
+        size_t newSize = memento->savedText.size();
+        size_t prefix = memento->savedText.matchAt(0, data, std::min(oldSize, newSize));
+        size_t suffix = memento->savedText.matchSuffix(data + oldSize, std::min(oldSize, newSize) - prefix);
+        if (capacity < memento->savedCapacity) {
+            resize(memento->savedCapacity);
+        }
+        ownText(prefix, newSize + 1);
+        std::memmove(data + newSize - suffix, data + oldSize - suffix, suffix);
+        memento->savedText.copyTo(prefix, newSize - suffix - prefix, data + prefix);
+        size = newSize;
+        data[size] = '\0';
+        onEdit(prefix, oldSize - suffix - prefix, newSize - suffix - prefix);
+        recordEdit(prefix, oldSize - suffix - prefix, newSize - suffix - prefix);
+        delete memento;
+    }
+
+    // The lines of the text without their '\n', split in parallel. A final
+    // '\n' does not start another line.
+    std::vector<std::string_view> splitLines() const {
+        size_t chunks = (size + FileIO::CHUNK_SIZE - 1) / FileIO::CHUNK_SIZE;
+        std::vector<std::vector<size_t>> newlines(chunks);
+        parallelFor(chunks, [&](size_t i) {
+            const char* p = data + i * FileIO::CHUNK_SIZE;
+            const char* end = data + std::min(size, (i + 1) * FileIO::CHUNK_SIZE);
+            while ((p = static_cast<const char*>(std::memchr(p, '\n', end - p))) != nullptr) {
+                newlines[i].push_back(p - data);
+                p++;
+            }
+        });
+        std::vector<std::string_view> lines;
+        lines.reserve(textIndex->lineCount());
+        size_t start = 0;
+        for (auto &chunk : newlines) {
+            for (size_t newline : chunk) {
+                lines.emplace_back(data + start, newline - start);
+                start = newline + 1;
+            }
+        }
+        if (start < size) {
+            lines.emplace_back(data + start, size - start);
+        }
+        return lines;
+    }
+
+    // While recording, adds the replacement of oldLen bytes at pos by the
+    // newLen bytes now there as a macro step, widened to whole characters
+    // so it replays on character boundaries.
+    void recordEdit(size_t pos, size_t oldLen, size_t newLen) {
+        if (!recording) {
+            return;
+        }
+        size_t end = pos + newLen;
+        while (pos > 0 && isContinuationByte(data[pos])) {
+            pos--;
+            oldLen++;
+        }
+        while (end < size && isContinuationByte(data[end])) {
+            end++;
+            oldLen++;
+        }
+        addMacroStep(false, pos, oldLen, std::string(data + pos, end - pos));
+    }
+
+    // End of what a run touched, counted from its anchor, after a step
+    // replaced oldLen bytes at pos by newLen bytes. Steps ending at or
+    // before it only shift it; a step reaching past it moves it to the end
+    // of that step's text.
+    static size_t touchedEnd(size_t end, size_t pos, size_t oldLen, size_t newLen) {
+        return pos + oldLen <= end ? end - oldLen + newLen : pos + newLen;
+    }
+
+    // Records the replacement of oldLen bytes at pos by text as a macro step.
+    void addMacroStep(bool atEnd, size_t pos, size_t oldLen, const std::string& text) {
+        macro.push_back({atEnd, atEnd ? 0 : static_cast<long>(pos) - static_cast<long>(macroAnchor), oldLen, text});
+        macroEnd = touchedEnd(macroEnd, pos, oldLen, text.size());
+    }
+
+    // Composes one run of the macro at anchor; after gets the end of
+    // everything the run touched.
+    bool composeMacro(EditComposer& composer, size_t anchor, size_t& after) const {
+        after = anchor;
+        for (auto &step : macro) {
+            long pos = step.atEnd ? static_cast<long>(composer.size()) : static_cast<long>(anchor) + step.offset;
+            if (pos < 0 || !composer.apply(pos, step.oldLen, step.text)) {
+                return false;
+            }
+            after = touchedEnd(after, pos, step.oldLen, step.text.size());
+        }
+        return true;
+    }
+
+    struct LineSpan {
+        size_t begin;
+        size_t end;  // the '\n' or the end of the text
+    };
+
+    // Lines first..last, located through the line index once and then by
+    // walking forward.
+    std::vector<LineSpan> lineSpans(size_t first, size_t last) const {
+        std::vector<LineSpan> spans;
+        size_t begin = textIndex->lineStart(data, size, first);
+        for (size_t line = first; line <= last; line++) {
+            auto newline = static_cast<const char*>(std::memchr(data + begin, '\n', size - begin));
+            size_t end = newline ? newline - data : size;
+            spans.push_back({begin, end});
+            begin = end + 1;
+        }
+        return spans;
+    }
+
+    // Byte position of the given character column in a line, or the end of
+    // the line if it is shorter; missing gets the number of characters short.
+    size_t columnOffset(const LineSpan& line, size_t column, size_t& missing) const {
+        auto p = reinterpret_cast<const unsigned char*>(data);
+        size_t limit = std::min(line.end, line.begin + column);
+        size_t pos = skipAscii(p, line.begin, limit);
+        size_t chars = pos - line.begin;
+        while (pos < line.end && chars < column) {
+            pos++;
+            while (pos < line.end && isContinuationByte(data[pos])) {
+                pos++;
+            }
+            chars++;
+        }
+        missing = column - chars;
+        return pos;
+    }
+
+    bool validBlock(size_t firstLine, size_t lastLine) const {
+        if (firstLine > lastLine || lastLine >= textIndex->lineCount()) {
+            std::cout << "Invalid line range.\n";
+            return false;
+        }
+        return true;
+    }
+
+    void keepLines(std::vector<std::string_view>& lines, const std::vector<char>& keep) {
+        size_t before = lines.size();
+        size_t kept = 0;
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (keep[i]) {
+                lines[kept++] = lines[i];
+            }
+        }
+        lines.resize(kept);
+        replaceLines(lines);
+        std::cout << "Kept " << kept << " of " << before << " lines." << std::endl;
+    }
+
+    // Writes the lines into a new buffer in one pass and switches to it as
+    // one undo step. The text keeps or lacks its final '\n' as before, except
+    // that an empty last line is always terminated so it is not lost.
+    void replaceLines(const std::vector<std::string_view>& lines) {
+        bool finalNewline = (size > 0 && data[size - 1] == '\n') || (!lines.empty() && lines.back().empty());
+        size_t newSize = 0;
+        for (auto &line : lines) {
+            newSize += line.size() + 1;
+        }
+        if (!lines.empty() && !finalNewline) {
+            newSize--;
+        }
+        TextBuffer newBuffer(newSize + 1);
+        char* newData = newBuffer.data();
+        char* out = newData;
+        for (auto &line : lines) {
+            std::memcpy(out, line.data(), line.size());
+            out += line.size();
+            if (out < newData + newSize) {
+                *out++ = '\n';
+            }
+        }
+        size_t oldSize = size;
+        size_t prefix = commonPrefix(data, newData, std::min(oldSize, newSize));
+        size_t suffix = commonSuffix(data + oldSize, newData + newSize, std::min(oldSize, newSize) - prefix);
+        if (prefix == oldSize && oldSize == newSize) {
+            return;
+        }
+        careTaker.saveState(data, size, capacity);
+        buffer = std::move(newBuffer);
+        data = newData;
+        size = newSize;
+        capacity = newSize + 1;
+        data[size] = '\0';
+        onEdit(prefix, oldSize - suffix - prefix, newSize - suffix - prefix);
+        recordEdit(prefix, oldSize - suffix - prefix, newSize - suffix - prefix);
+    }
+
+    // Reads the file through FileIO; each chunk is validated and indexed on
+    // a worker thread as soon as it arrives, and the per-chunk results are
+    // merged at the end. With a sidecar, each of its blocks is checked
+    // against the hash of the bytes it covers instead, as soon as they have
+    // all arrived.
+    bool readFileParallel(const std::string& filename, FileIO::Backend backend = FileIO::AUTO) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            close(fd);
+            return false;
+        }
+        size_t fileSize = info.st_size;
+        TextBuffer newBuffer(fileSize + 1);
+        char* newData = newBuffer.data();
+        size_t chunks = (fileSize + FileIO::CHUNK_SIZE - 1) / FileIO::CHUNK_SIZE;
+        std::vector<Utf8ChunkScan> scans(chunks);
+        std::vector<std::vector<TextBlock>> chunkBlocks(chunks);
+        std::vector<TextBlock> cachedBlocks;
+        bool cachedUtf8 = true;
+        bool cached = useSidecar && readSidecar(filename, info, cachedUtf8, cachedBlocks);
+        std::vector<size_t> cachedStarts(1, 0);  // offset of each cached block, then the end
+        for (auto &block : cachedBlocks) {
+            cachedStarts.push_back(cachedStarts.back() + block.length);
+        }
+        std::atomic<bool> stale(false);
+        auto checkCached = [&](size_t b) {
+            if (hashBytes(newData + cachedStarts[b], cachedBlocks[b].length) != cachedBlocks[b].hash) {
+                stale = true;
+            }
+        };
+        auto indexChunk = [&](size_t i, size_t begin, size_t end) {
+            scans[i] = scanUtf8Chunk(newData, begin, end, fileSize);
+            chunkBlocks[i] = TextIndex::summarizeChunk(newData, begin, end);
+        };
+
+        bool ok = FileIO::transfer(false, fd, newData, fileSize, [&](size_t i, size_t begin, size_t end) {
+            if (!cached) {
+                indexChunk(i, begin, end);
+                return;
+            }
+            for (size_t b = std::lower_bound(cachedStarts.begin(), cachedStarts.end(), begin) - cachedStarts.begin();
+                 b < cachedBlocks.size() && cachedStarts[b + 1] <= end; b++) {
+                checkCached(b);
+            }
+        }, backend);
+        close(fd);
+        if (!ok) {
+            return false;
+        }
+        for (size_t b = 0; cached && b < cachedBlocks.size(); b++) {
+            if (cachedStarts[b] / FileIO::CHUNK_SIZE != (cachedStarts[b + 1] - 1) / FileIO::CHUNK_SIZE) {
+                checkCached(b);
+            }
+        }
+        if (cached && stale) {
+            // Changed without a change in size or mtime.
+            cached = false;
+            parallelFor(chunks, [&](size_t i) {
+                indexChunk(i, i * FileIO::CHUNK_SIZE, std::min(fileSize, (i + 1) * FileIO::CHUNK_SIZE));
+            });
+        }
+        bool utf8Valid = cached ? cachedUtf8 : mergeUtf8Scans(newData, fileSize, scans, FileIO::CHUNK_SIZE);
+        if (!utf8Valid) {
+            std::cout << "Warning: " << filename << " is not valid UTF-8\n";
+        }
+
+        buffer = std::move(newBuffer);
+        data = newData;
+        size = fileSize;
+        capacity = size + 1;
+        data[size] = '\0';
+        if (cached) {
+            textIndex.replace().assign(std::move(cachedBlocks));
+        } else {
+            textIndex.replace().joinChunks(data, chunkBlocks, FileIO::CHUNK_SIZE);
+        }
+        searchCache.replace().clear();
+        syntax.edit().rebuild(data, size, *textIndex);
+        knownUtf8 = utf8Valid;
+        if (useSidecar && !cached) {
+            writeSidecar(filename, utf8Valid);
+        }
+        return true;
+    }
+
+    static std::string sidecarName(const std::string& filename) {
+        return filename + ".idx";
+    }
+
+    // Index sidecars hold the index blocks of a file, stamped with the size,
+    // device, inode and mtime of the file they describe, whether its text is
+    // valid UTF-8 and a checksum of the blocks. The hashes in the blocks
+    // stand for the text, so a sidecar can be written after a save from the
+    // index alone. Returns false unless the stamp matches info and the blocks
+    // their checksum; the loader then checks the block hashes.
+    static bool readSidecar(const std::string& filename, const struct stat& info, bool& utf8Valid,
+                            std::vector<TextBlock>& blocks) {
+        std::ifstream inFile(sidecarName(filename), std::ios::binary);
+        char magic[4];
+        uint64_t fields[9];
+        if (!inFile.read(magic, sizeof(magic)) || std::memcmp(magic, SIDECAR_MAGIC, 4) != 0
+            || !inFile.read(reinterpret_cast<char*>(fields), sizeof(fields))) {
+            return false;
+        }
+        std::streamoff header = inFile.tellg();
+        inFile.seekg(0, std::ios::end);
+        uint64_t payload = inFile.tellg() - header;
+        inFile.seekg(header);
+        if (fields[0] != sizeof(TextBlock) || fields[1] != static_cast<uint64_t>(info.st_size)
+            || fields[2] != static_cast<uint64_t>(info.st_dev) || fields[3] != static_cast<uint64_t>(info.st_ino)
+            || fields[4] != static_cast<uint64_t>(info.st_mtim.tv_sec) || fields[5] != static_cast<uint64_t>(info.st_mtim.tv_nsec)
+            || fields[7] != payload / sizeof(TextBlock) || payload % sizeof(TextBlock) != 0) {
+            return false;
+        }
+        utf8Valid = fields[6] != 0;
+        blocks.resize(fields[7]);
+        if (!inFile.read(reinterpret_cast<char*>(blocks.data()), blocks.size() * sizeof(TextBlock))
+            || hashBytes(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(TextBlock)) != fields[8]) {
+            return false;
+        }
+        size_t indexed = 0;
+        for (auto &block : blocks) {
+            indexed += block.length;
+        }
+        return indexed == fields[1];
+    }
+
+    // Writes the sidecar for the current text, which must match the file.
+    // It goes to a temporary name first so a reader never sees half of it.
+    void writeSidecar(const std::string& filename, bool utf8Valid) const {
+        struct stat info;
+        if (stat(filename.c_str(), &info) != 0) {
+            return;
+        }
+        const std::vector<TextBlock>& blocks = textIndex->allBlocks();
+        uint64_t fields[9] = {sizeof(TextBlock), static_cast<uint64_t>(info.st_size), static_cast<uint64_t>(info.st_dev),
+                              static_cast<uint64_t>(info.st_ino), static_cast<uint64_t>(info.st_mtim.tv_sec),
+                              static_cast<uint64_t>(info.st_mtim.tv_nsec), utf8Valid, blocks.size(),
+                               hashBytes(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(TextBlock))};
+        std::string temporary = sidecarName(filename) + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return;
+        }
+        bool ok = writeAll(fd, SIDECAR_MAGIC, 4) && writeAll(fd, reinterpret_cast<const char*>(fields), sizeof(fields))
+                  && writeAll(fd, reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(TextBlock));
+        if (close(fd) != 0 || !ok || rename(temporary.c_str(), sidecarName(filename).c_str()) != 0) {
+            unlink(temporary.c_str());
+        }
+    }
+
+    void rememberDiskText() {
+        diskText = ChunkedText::store(data, size, &diskText);
+        setDiskBlocks(textIndex->allBlocks());
+    }
+
+    // rememberDiskText after a save, while the dirty ranges still tell what
+    // changed since diskText: only those ranges are cut again.
+    void rememberSavedText() {
+        diskText = ChunkedText::patch(diskText, data, size, dirty.get(), dirty.untouchedTail());
+        setDiskBlocks(textIndex->allBlocks());
+    }
+
+    void setDiskBlocks(std::vector<TextBlock> blocks) {
+        auto starts = std::make_shared<std::vector<size_t>>(1, 0);
+        for (auto &block : blocks) {
+            starts->push_back(starts->back() + block.length);
+        }
+        diskBlocks = std::make_shared<const std::vector<TextBlock>>(std::move(blocks));
+        diskStarts = std::move(starts);
+    }
+
+    // Bytes at the start and end of the text known equal to diskText: those
+    // before the first dirty range, and those at the end that no edit has
+    // touched. Costs O(1).
+    void equalToDisk(size_t& prefix, size_t& suffix) const {
+        size_t common = std::min(size, diskText.size());
+        prefix = std::min(common, dirty.empty() ? size : dirty.get().front().first);
+        suffix = std::min(common - prefix, dirty.untouchedTail());
+    }
+
+    // Whether bytes [begin, end) equal diskText at the same offsets. A block
+    // that starts where a disk block starts and matches it by length and
+    // hash is taken as equal; the bytes of the others are compared.
+    bool rangeMatchesDisk(size_t begin, size_t end) const {
+        const std::vector<TextBlock>& blocks = textIndex->allBlocks();
+        const std::vector<TextBlock>& oldBlocks = *diskBlocks;
+        const std::vector<size_t>& oldStarts = *diskStarts;
+        size_t pending = begin;  // start of the bytes still to compare
+        size_t start;
+        for (size_t i = textIndex->blockOf(begin, start); i < blocks.size() && start < end; start += blocks[i++].length) {
+            auto disk = std::lower_bound(oldStarts.begin(), oldStarts.end(), start);
+            size_t j = disk - oldStarts.begin();
+            if (disk == oldStarts.end() || *disk != start || j == oldBlocks.size()
+                || oldBlocks[j].length != blocks[i].length || oldBlocks[j].hash != blocks[i].hash) {
+                continue;
+            }
+            if (pending < start && diskText.matchAt(pending, data + pending, start - pending) != start - pending) {
+                return false;
+            }
+            pending = std::max(pending, start + blocks[i].length);
+        }
+        return pending >= end || diskText.matchAt(pending, data + pending, end - pending) == end - pending;
+    }
+
+    // Whether the text equals diskText. Only the dirty ranges between the
+    // known equal ends are compared, so this costs the changed blocks, not
+    // the whole text.
+    bool matchesDisk() const {
+        if (size != diskText.size()) {
+            return false;
+        }
+        size_t prefix;
+        size_t suffix;
+        equalToDisk(prefix, suffix);
+        for (auto &range : dirty.get()) {
+            size_t begin = std::max(range.first, prefix);
+            size_t end = std::min(range.second, size - suffix);
+            if (begin < end && !rangeMatchesDisk(begin, end)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool isValidUtf8() const {
+        size_t chunks = (size + FileIO::CHUNK_SIZE - 1) / FileIO::CHUNK_SIZE;
+        std::vector<Utf8ChunkScan> scans(chunks);
+        parallelFor(chunks, [&](size_t i) {
+            size_t begin = i * FileIO::CHUNK_SIZE;
+            scans[i] = scanUtf8Chunk(data, begin, std::min(size, begin + FileIO::CHUNK_SIZE), size);
+        });
+        return mergeUtf8Scans(data, size, scans, FileIO::CHUNK_SIZE);
+    }
+
+    bool writeFileParallel(const std::string& filename, FileIO::Backend backend = FileIO::AUTO) {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            return false;
+        }
+        bool ok = FileIO::transfer(true, fd, data, size, [](size_t, size_t, size_t) {}, backend);
+        return close(fd) == 0 && ok;
+    }
+
+    // Rewrites only the dirty ranges of the file we last loaded or saved,
+    // rounded out to whole pages. Gives up (returning false) when the file has
+    // changed on disk or so much is dirty that a streamed rewrite is as cheap.
+    bool patchFile(const std::string& filename) {
+        DiskState current;
+        if (diskState.compressed || !current.read(filename) || !current.sameAs(diskState)
+            || dirty.totalBytes() > size / 2) {
+            return false;
+        }
+        int fd = open(filename.c_str(), O_WRONLY);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = true;
+        for (auto &range : dirty.get()) {
+            size_t begin = range.first / PATCH_ALIGNMENT * PATCH_ALIGNMENT;
+            size_t end = std::min(size, (range.second + PATCH_ALIGNMENT - 1) / PATCH_ALIGNMENT * PATCH_ALIGNMENT);
+            while (ok && begin < end) {
+                ssize_t written = pwrite(fd, data + begin, end - begin, begin);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                ok = written > 0;
+                begin += ok ? written : 0;
+            }
+        }
+        if (ok && size < diskState.size) {
+            ok = ftruncate(fd, size) == 0;
+        }
+        if (close(fd) != 0) {
+            ok = false;
+        }
+        return ok;
+    }
+
+    static bool isCompressedName(const std::string& filename) {
+        const std::string extension = ".lzc";
+        return filename.size() > extension.size()
+               && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+    }
+
+    static bool hasCompressedMagic(const std::string& filename) {
+        char header[LzCodec::HEADER_SIZE];
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        bool found = pread(fd, header, sizeof(header), 0) == sizeof(header)
+                     && std::memcmp(header, LzCodec::magic(), sizeof(header)) == 0;
+        close(fd);
+        return found;
+    }
+
+    static bool writeAll(int fd, const char* buffer, size_t len) {
+        while (len > 0) {
+            ssize_t written = ::write(fd, buffer, len);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            buffer += written;
+            len -= written;
+        }
+        return true;
+    }
+
+    static bool readAll(int fd, char* buffer, size_t len, size_t offset) {
+        while (len > 0) {
+            ssize_t got = pread(fd, buffer, len, offset);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            buffer += got;
+            len -= got;
+            offset += got;
+        }
+        return true;
+    }
+
+    // Streams the compressed file: the frame headers are read first to size
+    // the text, then each payload is read and handed to a worker that
+    // decompresses, validates and indexes it in place while the next one is
+    // read. Only a few payloads are held at a time.
+    bool readCompressedFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < LzCodec::HEADER_SIZE) {
+            close(fd);
+            return false;
+        }
+        size_t fileSize = info.st_size;
+
+        struct Frame {
+            size_t packedOffset;
+            size_t storedLen;
+            size_t rawLen;
+        };
+        std::vector<Frame> frames;
+        size_t in = LzCodec::HEADER_SIZE;
+        size_t rawSize = 0;
+        while (in < fileSize) {
+            char header[LzCodec::FRAME_HEADER_SIZE];
+            uint32_t rawLen, storedLen;
+            if (fileSize - in < sizeof(header) || !readAll(fd, header, sizeof(header), in)) {
+                close(fd);
+                return false;
+            }
+            std::memcpy(&rawLen, header, 4);
+            std::memcpy(&storedLen, header + 4, 4);
+            in += sizeof(header);
+            bool lastFrame = in + storedLen >= fileSize;
+            if (storedLen > fileSize - in || rawLen > LzCodec::CHUNK_SIZE || (!lastFrame && rawLen != LzCodec::CHUNK_SIZE)) {
+                close(fd);
+                return false;
+            }
+            frames.push_back({in, storedLen, rawLen});
+            in += storedLen;
+            rawSize += rawLen;
+        }
+
+        TextBuffer newBuffer(rawSize + 1);
+        char* newData = newBuffer.data();
+        std::vector<Utf8ChunkScan> scans(frames.size());
+        std::vector<std::vector<TextBlock>> chunkBlocks(frames.size());
+        std::atomic<bool> failed(false);
+        const size_t maxPayloads = 2 * std::max(1u, std::thread::hardware_concurrency());
+        size_t payloads = 0;
+        std::mutex mutex;
+        std::condition_variable payloadDone;
+        {
+            WorkerPool workers;
+            for (size_t i = 0; i < frames.size() && !failed; i++) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    payloadDone.wait(lock, [&]() { return payloads < maxPayloads; });
+                    payloads++;
+                }
+                auto payload = std::make_shared<std::vector<char>>(frames[i].storedLen);
+                if (!readAll(fd, payload->data(), payload->size(), frames[i].packedOffset)) {
+                    failed = true;
+                    break;
+                }
+                workers.submit([&, i, payload]() {
+                    size_t begin = i * LzCodec::CHUNK_SIZE;
+                    size_t end = begin + frames[i].rawLen;
+                    if (!LzCodec::decompressFrame(payload->data(), payload->size(), newData + begin, frames[i].rawLen)) {
+                        failed = true;
+                    } else {
+                        scans[i] = scanUtf8Chunk(newData, begin, end, rawSize);
+                        chunkBlocks[i] = TextIndex::summarizeChunk(newData, begin, end);
+                    }
+                    std::lock_guard<std::mutex> lock(mutex);
+                    payloads--;
+                    payloadDone.notify_one();
+                });
+            }
+            workers.wait();
+        }
+        close(fd);
+        if (failed) {
+            return false;
+        }
+        bool utf8Valid = mergeUtf8Scans(newData, rawSize, scans, LzCodec::CHUNK_SIZE);
+        if (!utf8Valid) {
+            std::cout << "Warning: " << filename << " is not valid UTF-8\n";
+        }
+
+        buffer = std::move(newBuffer);
+        data = newData;
+        size = rawSize;
+        capacity = size + 1;
+        data[size] = '\0';
+        textIndex.replace().joinChunks(data, chunkBlocks, LzCodec::CHUNK_SIZE);
+        searchCache.replace().clear();
+        syntax.edit().rebuild(data, size, *textIndex);
+        knownUtf8 = utf8Valid;
+        return true;
+    }
+
+    // Compresses a batch of chunks on all cores, then streams the frames out
+    // in order, so memory use stays bounded by the batch.
+    bool writeCompressedFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = writeAll(fd, LzCodec::magic(), LzCodec::HEADER_SIZE);
+        size_t chunks = (size + LzCodec::CHUNK_SIZE - 1) / LzCodec::CHUNK_SIZE;
+        size_t batch = 4 * std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::string> frames(batch);
+        for (size_t first = 0; ok && first < chunks; first += batch) {
+            size_t count = std::min(batch, chunks - first);
+            parallelFor(count, [&](size_t i) {
+                size_t begin = (first + i) * LzCodec::CHUNK_SIZE;
+                size_t end = std::min(size, begin + LzCodec::CHUNK_SIZE);
+                LzCodec::compressFrame(data + begin, end - begin, frames[i]);
+            });
+            for (size_t i = 0; ok && i < count; i++) {
+                ok = writeAll(fd, frames[i].data(), frames[i].size());
+            }
+        }
+        if (close(fd) != 0) {
+            ok = false;
+        }
+        return ok;
+    }
+
+    // Rebuilds one chunk list written by saveSession from the list words at
+    // pos: ref's leading and trailing chunks with the table chunks between.
+    // Advances pos past the list and gets its stored capacity.
+    static bool readSessionList(const std::vector<uint64_t>& words, size_t& pos, const ChunkedText::ChunkList& table,
+                                const ChunkedText& ref, ChunkedText& list, uint64_t& listCapacity) {
+        const ChunkedText::ChunkList& old = ref.chunkList();
+        if (words.size() - pos < 4) {
+            return false;
+        }
+        uint64_t front = words[pos], back = words[pos + 1], count = words[pos + 2];
+        listCapacity = words[pos + 3];
+        pos += 4;
+        if (front > old.size() || back > old.size() - front || count > words.size() - pos) {
+            return false;
+        }
+        ChunkedText::ChunkList pieces(old.begin(), old.begin() + front);
+        for (size_t i = 0; i < count; i++) {
+            if (words[pos + i] >= table.size()) {
+                return false;
+            }
+            pieces.push_back(table[words[pos + i]]);
+        }
+        pos += count;
+        pieces.insert(pieces.end(), old.end() - back, old.end());
+        list = ChunkedText::fromChunks(std::move(pieces));
+        return true;
+    }
+
+public:
+    DynamicArray() : buffer(10), size(0), capacity(10) {
+        data = buffer.data();
+        data[0] = '\0';
+    }
+
+    void append(const char* text) {
+        careTaker.saveState(data, size, capacity);
+        size_t len = strlen(text);
+        while (size + len >= capacity) {
+            resize(capacity * 2);
+        }
+        ownText(size, size + len + 1);
+        std::strcpy(data + size, text);
+        size += len;
+        onEdit(size - len, 0, len);
+        if (recording) {
+            addMacroStep(true, size - len, 0, text);
+        }
+    }
+
+    // A new document with this one's text, history, clipboard and disk
+    // state. The snapshots, clipboard and disk copy share their chunks for
+    // good. The live text shares its buffer slots, and the indexes and
+    // search cache are shared whole, each until one side changes it; an
+    // edit then copies the slots it writes and the structures it updates.
+    // Recording is not carried over.
+    std::unique_ptr<DynamicArray> clone() {
+        auto copy = std::make_unique<DynamicArray>();
+        copy->buffer = buffer.share();
+        copy->data = copy->buffer.data();
+        copy->size = size;
+        copy->capacity = capacity;
+        copy->careTaker.copyFrom(careTaker);
+        copy->clipboard = clipboard;
+        copy->textIndex = textIndex;
+        copy->searchCache = searchCache;
+        copy->syntax = syntax;
+        copy->knownUtf8 = knownUtf8;
+        copy->diskText = diskText;
+        copy->diskBlocks = diskBlocks;
+        copy->diskStarts = diskStarts;
+        copy->diskState = diskState;
+        copy->dirty = dirty;
+        copy->useSidecar = useSidecar;
+        copy->macroAnchor = macroAnchor;
+        copy->macroEnd = macroEnd;
+        copy->macro = macro;
+        return copy;
+    }
+
+    bool isCharBoundary(size_t pos) const {
+        return pos >= size || !isContinuationByte(data[pos]);
+    }
+
+    // Byte offset of the character at the given line and column.
+    size_t positionOf(size_t line, size_t column) const {
+        size_t lineStart = textIndex->lineStart(data, size, line);
+        return textIndex->byteOffset(data, size, textIndex->charOffset(data, lineStart) + column);
+    }
+
+    // Line and character column of byte pos.
+    void locate(size_t pos, size_t& line, size_t& column) const {
+        line = textIndex->lineOf(data, pos);
+        size_t lineStart = textIndex->lineStart(data, size, line);
+        column = textIndex->charOffset(data, pos) - textIndex->charOffset(data, lineStart);
+    }
+
+    size_t wordCount() const {
+        return textIndex->wordCount();
+    }
+
+    void sortLines() {
+        std::vector<std::string_view> lines = splitLines();
+        parallelSort(lines);
+        replaceLines(lines);
+        std::cout << "Sorted " << lines.size() << " lines." << std::endl;
+    }
+
+    // Keeps the first copy of every line. Lines are hashed in parallel and
+    // sharded by hash, and each shard is deduplicated on its own core.
+    void uniqueLines() {
+        std::vector<std::string_view> lines = splitLines();
+        std::vector<uint64_t> hashes(lines.size());
+        size_t batches = (lines.size() + LINE_BATCH - 1) / LINE_BATCH;
+        parallelFor(batches, [&](size_t b) {
+            for (size_t i = b * LINE_BATCH; i < std::min(lines.size(), (b + 1) * LINE_BATCH); i++) {
+                hashes[i] = hashBytes(lines[i].data(), lines[i].size());
+            }
+        });
+        size_t shards = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::vector<size_t>> shardLines(shards);
+        for (size_t i = 0; i < lines.size(); i++) {
+            shardLines[hashes[i] % shards].push_back(i);
+        }
+        std::vector<char> keep(lines.size());
+        parallelFor(shards, [&](size_t s) {
+            auto hash = [&](size_t i) { return static_cast<size_t>(hashes[i]); };
+            auto equal = [&](size_t a, size_t b) { return hashes[a] == hashes[b] && lines[a] == lines[b]; };
+            std::unordered_set<size_t, decltype(hash), decltype(equal)> seen(shardLines[s].size(), hash, equal);
+            for (size_t i : shardLines[s]) {
+                keep[i] = seen.insert(i).second;
+            }
+        });
+        keepLines(lines, keep);
+    }
+
+    // Keeps the lines that contain the text, or with keepMatches false the
+    // lines that do not.
+    void filterLines(const std::string& search, SearchOptions options, bool keepMatches) {
+        std::vector<std::string_view> lines = splitLines();
+        SearchPattern pattern(search, options);
+        std::vector<char> keep(lines.size());
+        size_t batches = (lines.size() + LINE_BATCH - 1) / LINE_BATCH;
+        parallelFor(batches, [&](size_t b) {
+            for (size_t i = b * LINE_BATCH; i < std::min(lines.size(), (b + 1) * LINE_BATCH); i++) {
+                keep[i] = (pattern.find(lines[i].data(), lines[i].size(), 0) != SearchPattern::npos) == keepMatches;
+            }
+        });
+        keepLines(lines, keep);
+    }
+
+    // Position of the bracket matching the one at pos, or SIZE_MAX.
+    size_t matchBracket(size_t pos) const {
+        int delta = 0;
+        int type = pos < size ? bracketType(data[pos], delta) : -1;
+        if (type < 0) {
+            return SIZE_MAX;
+        }
+        return delta > 0 ? textIndex->findClose(data, size, pos + 1, type) : textIndex->findOpen(data, pos, type);
+    }
+
+    // Innermost bracket pair with open < pos <= close. Each bracket type is
+    // balanced on its own; close is SIZE_MAX when the block is never closed.
+    bool enclosingBlock(size_t pos, size_t& open, size_t& close) const {
+        open = SIZE_MAX;
+        for (int type = 0; type < BracketSummary::TYPES; type++) {
+            size_t candidate = textIndex->findOpen(data, std::min(pos, size), type);
+            if (candidate != SIZE_MAX && (open == SIZE_MAX || candidate > open)) {
+                open = candidate;
+            }
+        }
+        if (open == SIZE_MAX) {
+            return false;
+        }
+        close = matchBracket(open);
+        return true;
+    }
+
+    // Picks the lexer by name: "c", "ini" or "none".
+    bool setSyntax(const std::string& name) {
+        if (name == "c") {
+            syntax.edit().setLexer(std::unique_ptr<Lexer>(new CLikeLexer()), data, size, *textIndex);
+        } else if (name == "ini") {
+            syntax.edit().setLexer(std::unique_ptr<Lexer>(new IniLexer()), data, size, *textIndex);
+        } else if (name == "none") {
+            syntax.edit().setLexer(nullptr, data, size, *textIndex);
+        } else {
+            std::cout << "Unknown syntax.\n";
+            return false;
+        }
+        return true;
+    }
+
+    void printTokens(size_t line) const {
+        if (!syntax->enabled()) {
+            std::cout << "No syntax selected.\n";
+            return;
+        }
+        if (line >= textIndex->lineCount()) {
+            std::cout << "Invalid line.\n";
+            return;
+        }
+        for (auto &token : syntax->tokens(data, size, *textIndex, line)) {
+            std::cout << tokenKindName(token.kind) << " \"" << std::string(data + token.pos, token.length) << "\"" << std::endl;
+        }
+    }
+
+    // Byte, line, word and character counts in O(1).
+    void printStats() const {
+        const TextBlock& summary = textIndex->summary();
+        std::cout << "Bytes: " << size << "\n"
+                  << "Lines: " << textIndex->lineCount() << "\n"
+                  << "Words: " << summary.words << "\n"
+                  << "Characters: " << summary.codepoints << std::endl;
+    }
+
+    // Start of the first word after pos, or size if there is none.
+    size_t nextWord(size_t pos) const {
+        return textIndex->wordStart(data, size, textIndex->wordsBefore(data, std::min(pos + 1, size)));
+    }
+
+    // Start of the last word before pos, or size if there is none.
+    size_t previousWord(size_t pos) const {
+        size_t before = textIndex->wordsBefore(data, std::min(pos, size));
+        return before == 0 ? size : textIndex->wordStart(data, size, before - 1);
+    }
+
+    void replaceWord(size_t word, const char* text) {
+        size_t start = textIndex->wordStart(data, size, word);
+        if (start == size) {
+            std::cout << "Invalid word number.\n";
+            return;
+        }
+        insertAndReplace(start, text, scanWordBoundary(data, start, size, true) - start);
+    }
+
+    void insertAndReplace(size_t pos, const char* substring, size_t replaceLen) {
+        if (pos > size || pos + replaceLen > size) {
+            std::cout << "Invalid position or length.\n";
+            return;
+        }
+        if (!isCharBoundary(pos) || !isCharBoundary(pos + replaceLen)) {
+            std::cout << "Position splits a multi-byte character.\n";
+            return;
+        }
+        careTaker.saveState(data, size, capacity);
+        size_t len = strlen(substring);
+        if (size + len - replaceLen >= capacity) {
+            resize((size + len - replaceLen) * 2);
+        }
+        if (len == replaceLen) {
+            ownText(pos, pos + len);
+        } else {
+            ownText(pos, size + len - replaceLen + 1);
+            std::memmove(data + pos + len, data + pos + replaceLen, size - pos - replaceLen + 1);
+        }
+        std::memcpy(data + pos, substring, len);
+        size = size + len - replaceLen;
+        onEdit(pos, replaceLen, len);
+        if (recording) {
+            addMacroStep(false, pos, replaceLen, substring);
+        }
+    }
+
+    void deleteText(size_t pos, size_t len) {
+        if (pos >= size || pos + len > size) {
+            std::cout << "Invalid position or length.\n";
+            return;
+        }
+        if (!isCharBoundary(pos) || !isCharBoundary(pos + len)) {
+            std::cout << "Position splits a multi-byte character.\n";
+            return;
+        }
+        careTaker.saveState(data, size, capacity);
+        ownText(pos, size - len + 1);
+        std::memmove(data + pos, data + pos + len, size - pos - len);
+        size -= len;
+        data[size] = '\0';
+        onEdit(pos, len, 0);
+        if (recording) {
+            addMacroStep(false, pos, len, "");
+        }
+    }
+
+    void cutText(size_t pos, size_t len) {
+        if (pos >= size || pos + len > size) {
+            std::cout << "Invalid position or length.\n";
+            return;
+        }
+        if (!isCharBoundary(pos) || !isCharBoundary(pos + len)) {
+            std::cout << "Position splits a multi-byte character.\n";
+            return;
+        }
+        copyText(pos, len);
+        deleteText(pos, len);
+    }
+
+    void copyText(size_t pos, size_t len) {
+        if (pos >= size || pos + len > size) {
+            std::cout << "Invalid position or length.\n";
+            return;
+        }
+        if (!isCharBoundary(pos) || !isCharBoundary(pos + len)) {
+            std::cout << "Position splits a multi-byte character.\n";
+            return;
+        }
+        clipboard = ChunkedText::store(data + pos, len);
+    }
+
+    void pasteText(size_t pos) {
+        if (pos > size) {
+            std::cout << "Invalid position.\n";
+            return;
+        }
+        std::string text = clipboard.str();
+        insertAndReplace(pos, text.c_str(), 0);
+    }
+
+    // Rectangular blocks: character columns [column, column + width) of
+    // lines firstLine..lastLine. Copying puts the rows in the clipboard,
+    // one per line.
+    void copyBlock(size_t firstLine, size_t lastLine, size_t column, size_t width) {
+        if (!validBlock(firstLine, lastLine)) {
+            return;
+        }
+        std::vector<LineSpan> lines = lineSpans(firstLine, lastLine);
+        std::string rows;
+        for (size_t i = 0; i < lines.size(); i++) {
+            size_t missing;
+            size_t begin = columnOffset(lines[i], column, missing);
+            size_t end = columnOffset(lines[i], column + width, missing);
+            if (i > 0) {
+                rows += '\n';
+            }
+            rows.append(data + begin, end - begin);
+        }
+        clipboard = ChunkedText::store(rows.data(), rows.size());
+    }
+
+    void deleteBlock(size_t firstLine, size_t lastLine, size_t column, size_t width) {
+        if (!validBlock(firstLine, lastLine)) {
+            return;
+        }
+        std::vector<TextEdit> edits;
+        for (auto &line : lineSpans(firstLine, lastLine)) {
+            size_t missing;
+            size_t begin = columnOffset(line, column, missing);
+            size_t end = columnOffset(line, column + width, missing);
+            if (end > begin) {
+                edits.push_back({begin, end - begin, ""});
+            }
+        }
+        applyEdits(edits);
+    }
+
+    // Inserts the rows of text (split at '\n') at the column, one row per
+    // line from firstLine on; a single row goes into every line up to
+    // lastLine. Short lines are padded with spaces to reach the column.
+    void insertBlock(size_t firstLine, size_t lastLine, size_t column, const std::string& text) {
+        std::vector<std::string> rows(1);
+        for (char c : text) {
+            if (c == '\n') {
+                rows.emplace_back();
+            } else {
+                rows.back() += c;
+            }
+        }
+        if (rows.size() > 1) {
+            lastLine = firstLine + rows.size() - 1;
+        }
+        if (!validBlock(firstLine, lastLine)) {
+            return;
+        }
+        std::vector<TextEdit> edits;
+        std::vector<LineSpan> lines = lineSpans(firstLine, lastLine);
+        for (size_t i = 0; i < lines.size(); i++) {
+            size_t missing;
+            size_t pos = columnOffset(lines[i], column, missing);
+            const std::string& row = rows.size() > 1 ? rows[i] : rows[0];
+            if (!row.empty()) {
+                edits.push_back({pos, 0, std::string(missing, ' ') + row});
+            }
+        }
+        applyEdits(edits);
+    }
+
+    void pasteBlock(size_t line, size_t column) {
+        insertBlock(line, line, column, clipboard.str());
+    }
+
+    // Records every edit until stopRecording, including undo, redo and
+    // multi-edit commands, as literal steps with positions relative to anchor.
+    void startRecording(size_t anchor) {
+        recording = true;
+        macroAnchor = anchor;
+        macroEnd = anchor;
+        macro.clear();
+    }
+
+    // The recording counts as the first run, so replays go on from the end
+    // of what it touched.
+    void stopRecording() {
+        if (recording) {
+            macroAnchor = macroEnd;
+        }
+        recording = false;
+        std::cout << "Recorded " << macro.size() << " steps." << std::endl;
+    }
+
+    // Replays the macro the given number of times. Every run, the
+    // recording included, is followed by the next one anchored just past
+    // the end of everything it touched, wherever its last step was; so a
+    // run never edits inside the text the one before produced, and a later
+    // replay goes on where this one stopped. The runs are composed over the
+    // current text first and applied as one edit.
+    void replayMacro(size_t times) {
+        EditComposer composer(size);
+        size_t anchor = macroAnchor;
+        for (size_t i = 0; i < times; i++) {
+            if (!composeMacro(composer, anchor, anchor)) {
+                std::cout << "Macro does not fit the text.\n";
+                return;
+            }
+        }
+        if (applyEdits(composer.edits())) {
+            macroAnchor = anchor;
+        }
+    }
+
+    // Replays the macro once at every match, anchored at the match start.
+    // A match whose edits would reach into the previous match's is skipped.
+    void replayMacroAtMatches(const std::string& search, SearchOptions options) {
+        SearchPattern pattern(search, options);
+        std::vector<TextEdit> edits;
+        size_t runs = 0;
+        for (size_t pos = pattern.find(data, size, 0); pos != SearchPattern::npos && !search.empty();
+             pos = pattern.find(data, size, pos + search.size())) {
+            EditComposer composer(size);
+            size_t after;
+            if (!composeMacro(composer, pos, after)) {
+                continue;
+            }
+            std::vector<TextEdit> local = composer.edits();
+            if (local.empty() || (!edits.empty() && local.front().pos < edits.back().pos + edits.back().oldLen)) {
+                continue;
+            }
+            edits.insert(edits.end(), local.begin(), local.end());
+            runs++;
+        }
+        if (applyEdits(edits)) {
+            std::cout << "Replayed the macro at " << runs << " matches." << std::endl;
+        }
+    }
+
+    // With sidecars on, loading a plain file reuses a matching index
+    // sidecar instead of indexing, and loads and saves write one.
+    void setIndexSidecar(bool enabled) {
+        useSidecar = enabled;
+        std::cout << "Index sidecar files " << (enabled ? "on" : "off") << std::endl;
+    }
+
+    // Writes the text, clipboard, index blocks and undo/redo history to a
+    // session file. The header is 64-bit fields, including a checksum of the
+    // blocks. Every stored text is a list of chunks: the distinct chunks are
+    // written once, as a table of lengths and hashes followed by their bytes,
+    // and after the blocks each list is written as the number of leading and
+    // trailing chunks it shares with its neighbour nearer the current text,
+    // compared by pointer, and the table indices of the chunks between. So a
+    // snapshot costs the chunks where it differs, not a compare of its text.
+    void saveSession(const std::string& filename) const {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cout << "Failed to save session to " << filename << std::endl;
+            return;
+        }
+        const std::vector<TextBlock>& blocks = textIndex->allBlocks();
+        const std::vector<Memento*>& undoStates = careTaker.undoStates();
+        const std::vector<Memento*>& redoStates = careTaker.redoStates();
+        const Memento* newest = !undoStates.empty() ? undoStates.back() : !redoStates.empty() ? redoStates.back() : nullptr;
+        ChunkedText text = ChunkedText::store(data, size, newest ? &newest->savedText : nullptr);
+
+        std::unordered_map<const std::string*, uint64_t> tableIndex;
+        ChunkedText::ChunkList table;
+        std::vector<uint64_t> lists;
+        auto addList = [&](const ChunkedText& list, const ChunkedText& ref, uint64_t listCapacity) {
+            const ChunkedText::ChunkList& pieces = list.chunkList();
+            const ChunkedText::ChunkList& old = ref.chunkList();
+            size_t front = 0;
+            while (front < pieces.size() && front < old.size() && pieces[front] == old[front]) {
+                front++;
+            }
+            size_t back = 0;
+            while (back < pieces.size() - front && back < old.size() - front
+                   && pieces[pieces.size() - 1 - back] == old[old.size() - 1 - back]) {
+                back++;
+            }
+            lists.insert(lists.end(), {front, back, pieces.size() - front - back, listCapacity});
+            for (size_t i = front; i < pieces.size() - back; i++) {
+                auto entry = tableIndex.emplace(pieces[i].get(), table.size());
+                if (entry.second) {
+                    table.push_back(pieces[i]);
+                }
+                lists.push_back(entry.first->second);
+            }
+        };
+        addList(text, ChunkedText(), capacity);
+        addList(clipboard, ChunkedText(), 0);
+        for (auto stack : {&undoStates, &redoStates}) {
+            const ChunkedText* ref = &text;
+            for (size_t i = stack->size(); i-- > 0;) {
+                addList((*stack)[i]->savedText, *ref, (*stack)[i]->savedCapacity);
+                ref = &(*stack)[i]->savedText;
+            }
+        }
+        std::vector<uint64_t> entries(2 * table.size());
+        parallelFor(table.size(), [&](size_t i) {
+            entries[2 * i] = table[i]->size();
+            entries[2 * i + 1] = hashBytes(table[i]->data(), table[i]->size());
+        });
+
+        std::string header(SESSION_MAGIC, 4);
+        for (uint64_t field : {uint64_t(sizeof(TextBlock)), uint64_t(size), uint64_t(blocks.size()), uint64_t(undoStates.size()),
+                               uint64_t(redoStates.size()), uint64_t(table.size()), uint64_t(lists.size()),
+                               hashBytes(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(TextBlock))}) {
+            header.append(reinterpret_cast<const char*>(&field), sizeof(field));
+        }
+        bool ok = writeAll(fd, header.data(), header.size())
+                  && writeAll(fd, reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(uint64_t));
+        for (size_t i = 0; ok && i < table.size(); i++) {
+            ok = writeAll(fd, table[i]->data(), table[i]->size());
+        }
+        ok = ok && writeAll(fd, reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(TextBlock))
+             && writeAll(fd, reinterpret_cast<const char*>(lists.data()), lists.size() * sizeof(uint64_t));
+        if (close(fd) != 0) {
+            ok = false;
+        }
+        std::cout << (ok ? "Saved session to " : "Failed to save session to ") << filename << std::endl;
+    }
+
+    // Maps a session file and rebuilds the text, clipboard and history from
+    // its chunk table, without cutting or re-indexing the text. Each chunk
+    // is checked against its hash and interned once; the lists then only
+    // take chunk references, and the text is copied out of its chunks.
+    // Blocks that fail their checksum are rebuilt from the text. The session
+    // is not what is on disk, so there is no disk copy to diff against
+    // afterwards.
+    void loadSession(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            std::cout << "Failed to load session from " << filename << std::endl;
+            return;
+        }
+        size_t fileSize = info.st_size;
+        void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            std::cout << "Failed to load session from " << filename << std::endl;
+            return;
+        }
+        const char* p = static_cast<const char*>(mapped);
+        const char* end = p + fileSize;
+        uint64_t fields[8] = {};
+        bool ok = fileSize >= 4 + sizeof(fields) && std::memcmp(p, SESSION_MAGIC, 4) == 0;
+        if (ok) {
+            std::memcpy(fields, p + 4, sizeof(fields));
+            p += 4 + sizeof(fields);
+        }
+        uint64_t blockBytes = fields[0], textSize = fields[1], blockCount = fields[2], undoCount = fields[3];
+        uint64_t redoCount = fields[4], chunkCount = fields[5], listWords = fields[6], blocksChecksum = fields[7];
+        ok = ok && blockBytes == sizeof(TextBlock) && chunkCount <= static_cast<size_t>(end - p) / 16;
+        std::vector<uint64_t> entries(ok ? 2 * chunkCount : 0);
+        std::vector<size_t> offsets(entries.size() / 2 + 1, 0);
+        if (ok) {
+            std::memcpy(entries.data(), p, entries.size() * sizeof(uint64_t));
+            p += entries.size() * sizeof(uint64_t);
+            for (size_t i = 0; ok && i < chunkCount; i++) {
+                ok = entries[2 * i] <= static_cast<size_t>(end - p) - offsets[i];
+                offsets[i + 1] = offsets[i] + (ok ? entries[2 * i] : 0);
+            }
+        }
+        ChunkedText::ChunkList table(ok ? chunkCount : 0);
+        std::atomic<bool> damaged(false);
+        parallelFor(table.size(), [&](size_t i) {
+            size_t len = entries[2 * i];
+            uint64_t hash = hashBytes(p + offsets[i], len);
+            if (hash != entries[2 * i + 1]) {
+                damaged = true;
+                return;
+            }
+            table[i] = ChunkStore::shared().intern(p + offsets[i], len, hash);
+        });
+        ok = ok && !damaged;
+        const char* storedBlocks = nullptr;
+        std::vector<uint64_t> lists;
+        if (ok) {
+            p += offsets.back();
+            storedBlocks = p;
+            ok = blockCount <= static_cast<size_t>(end - p) / sizeof(TextBlock);
+        }
+        if (ok) {
+            p += blockCount * sizeof(TextBlock);
+            ok = listWords <= static_cast<size_t>(end - p) / sizeof(uint64_t) && undoCount <= listWords / 4
+                 && redoCount <= listWords / 4 - undoCount;
+        }
+        if (ok) {
+            lists.resize(listWords);
+            std::memcpy(lists.data(), p, listWords * sizeof(uint64_t));
+        }
+
+        std::vector<Memento*> undoStates(ok ? undoCount : 0, nullptr);
+        std::vector<Memento*> redoStates(ok ? redoCount : 0, nullptr);
+        ChunkedText text;
+        ChunkedText clipboardText;
+        uint64_t textCapacity = 0;
+        uint64_t ignored;
+        size_t at = 0;
+        ok = ok && readSessionList(lists, at, table, ChunkedText(), text, textCapacity) && text.size() == textSize
+             && readSessionList(lists, at, table, ChunkedText(), clipboardText, ignored);
+        for (auto stack : {&undoStates, &redoStates}) {
+            const ChunkedText* ref = &text;
+            for (size_t i = stack->size(); ok && i-- > 0;) {
+                ChunkedText saved;
+                uint64_t savedCapacity;
+                ok = readSessionList(lists, at, table, *ref, saved, savedCapacity);
+                if (ok) {
+                    // Stored capacities are only a hint.
+                    savedCapacity = std::max<size_t>(std::min<uint64_t>(savedCapacity, fileSize), saved.size() + 1);
+                    (*stack)[i] = new Memento(std::move(saved), savedCapacity);
+                    ref = &(*stack)[i]->savedText;
+                }
+            }
+        }
+        if (!ok) {
+            for (auto memento : undoStates) {
+                delete memento;
+            }
+            for (auto memento : redoStates) {
+                delete memento;
+            }
+            munmap(mapped, fileSize);
+            std::cout << "Failed to load session from " << filename << std::endl;
+            return;
+        }
+        size = textSize;
+        capacity = std::max<size_t>(std::min<uint64_t>(textCapacity, fileSize), size + 1);
+        buffer = TextBuffer(capacity);
+        data = buffer.data();
+        text.copyTo(0, size, data);
+        data[size] = '\0';
+        clipboard = clipboardText;
+        std::vector<TextBlock> blocks(blockCount);
+        if (blockCount > 0) {
+            std::memcpy(blocks.data(), storedBlocks, blockCount * sizeof(TextBlock));
+        }
+        size_t indexed = 0;
+        for (auto &block : blocks) {
+            indexed += block.length;
+        }
+        if (indexed == size && hashBytes(storedBlocks, blockCount * sizeof(TextBlock)) == blocksChecksum) {
+            textIndex.replace().assign(std::move(blocks));
+        } else {
+            textIndex.replace().build(data, size);
+        }
+        careTaker.replaceStacks(std::move(undoStates), std::move(redoStates));
+        munmap(mapped, fileSize);
+        searchCache.replace().clear();
+        syntax.edit().rebuild(data, size, *textIndex);
+        diskText = ChunkedText();
+        setDiskBlocks({});
+        diskState.valid = false;
+        knownUtf8 = false;
+        dirty.markAll();
+        recording = false;
+        std::cout << "Loaded session from " << filename << std::endl;
+    }
+
+    void undo() {
+        // Save the current state to the redo stack before undoing
+        careTaker.pushToRedo(data, size, capacity);
+        Memento* memento = careTaker.undo();
+        if (memento) {
+            restore(memento);
+        } else {
+            std::cout << "Cannot undo further.\n";
+        }
+    }
+
+    void redo() {
+        // Save the current state to the undo stack before redoing
+        careTaker.pushToUndo(data, size, capacity);
+        Memento* memento = careTaker.redo();
+        if (memento) {
+            restore(memento);
+        } else {
+            std::cout << "Cannot redo further.\n";
+        }
+    }
+
+    const char* getText() const {
+        return data;
+    }
+
+    size_t getSize() const {
+        return size;
+    }
+
+    size_t findText(const char* search) const {
+        return findText(search, SearchOptions());
+    }
+
+    // First match at or after from.
+    size_t findText(const std::string& search, SearchOptions options, size_t from = 0) const {
+        return SearchPattern(search, options).find(data, size, from);
+    }
+
+    // Every match, overlapping ones included, served from the cache when
+    // the same query ran before.
+    const std::vector<size_t>& findAll(const std::string& search, SearchOptions options) {
+        return searchCache.edit().findAll(data, size, search, options);
+    }
+
+    // Last match starting before the given position.
+    size_t findPrevious(const std::string& search, SearchOptions options, size_t before) const {
+        return SearchPattern(search, options).rfind(data, size, before);
+    }
+
+    std::vector<PatternMatch> findPatterns(const std::vector<std::string>& patterns) const {
+        return MultiPattern(patterns).findAll(data, size);
+    }
+
+    void findApproximate(const std::string& search, size_t maxEdits) const {
+        FuzzyPattern pattern(search, maxEdits);
+        if (!pattern.valid()) {
+            std::cout << "The text must be 1 to " << FuzzyPattern::MAX_PATTERN << " bytes and longer than the number of edits.\n";
+            return;
+        }
+        std::vector<FuzzyMatch> matches = pattern.findAll(data, size);
+        for (auto &match : matches) {
+            std::cout << "Found \"" << std::string(data + match.pos, match.length) << "\" at position " << match.pos
+                      << " (" << match.distance << " edits)" << std::endl;
+        }
+        if (matches.empty()) {
+            std::cout << "Text not found." << std::endl;
+        }
+    }
+
+    void saveToFile(const std::string& filename) {
+        DiskState current;
+        bool upToDate = (dirty.empty() || matchesDisk()) && current.read(filename) && current.sameAs(diskState);
+        bool compressed = isCompressedName(filename) || (diskState.compressed && diskState.path == filename);
+        if (compressed) {
+            if (upToDate || writeCompressedFile(filename)) {
+                rememberSavedText();
+                diskState.read(filename);
+                diskState.compressed = true;
+                dirty.clear();
+                std::cout << "Saved to " << filename << std::endl;
+            } else {
+                std::cout << "Failed to save to " << filename << std::endl;
+            }
+            return;
+        }
+        if (upToDate || patchFile(filename) || writeFileParallel(filename)) {
+            rememberSavedText();
+            diskState.read(filename);
+            dirty.clear();
+            if (useSidecar && !upToDate) {
+                // Edits keep knownUtf8 from their own bytes; only a text of
+                // unknown or invalid UTF-8 is scanned.
+                knownUtf8 = knownUtf8 || isValidUtf8();
+                writeSidecar(filename, knownUtf8);
+            }
+            std::cout << "Saved to " << filename << std::endl;
+            return;
+        }
+        std::ofstream outFile(filename);
+        if (outFile.is_open()) {
+            outFile << data;
+            outFile.close();
+            rememberDiskText();
+            diskState.valid = false;
+            std::cout << "Saved to " << filename << std::endl;
+        } else {
+            std::cout << "Failed to save to " << filename << std::endl;
+        }
+    }
+
+    void loadFromFile(const std::string& filename) {
+        // A text file may start with the magic too; if its frames do not
+        // parse, it is loaded as text.
+        if (hasCompressedMagic(filename) && readCompressedFile(filename)) {
+            rememberDiskText();
+            diskState.read(filename);
+            diskState.compressed = true;
+            dirty.clear();
+            std::cout << "Loaded from " << filename << std::endl;
+            return;
+        }
+        if (readFileParallel(filename)) {
+            rememberDiskText();
+            diskState.read(filename);
+            dirty.clear();
+            std::cout << "Loaded from " << filename << std::endl;
+            return;
+        }
+        std::ifstream inFile(filename);
+        if (inFile.is_open()) {
+            std::string content((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+            size = content.size();
+            capacity = size + 1;
+            buffer = TextBuffer(capacity);
+            data = buffer.data();
+            std::strcpy(data, content.c_str());
+            textIndex.replace().build(data, size);
+            searchCache.replace().clear();
+            syntax.edit().rebuild(data, size, *textIndex);
+            knownUtf8 = false;
+            rememberDiskText();
+            diskState.valid = false;
+            dirty.markAll();
+            inFile.close();
+            std::cout << "Loaded from " << filename << std::endl;
+        } else {
+            std::cout << "Failed to load from " << filename << std::endl;
+        }
+    }
+    // Applies sorted, non-overlapping edits in one pass over the text,
+    // as a single undo step.
+    bool applyEdits(const std::vector<TextEdit>& edits) {
+        size_t newSize = size;
+        for (size_t i = 0; i < edits.size(); i++) {
+            const TextEdit& edit = edits[i];
+            bool overlaps = i > 0 && edits[i - 1].pos + edits[i - 1].oldLen > edit.pos;
+            if (overlaps || edit.pos > size || edit.oldLen > size - edit.pos
+                || !isCharBoundary(edit.pos) || !isCharBoundary(edit.pos + edit.oldLen)) {
+                std::cout << "Invalid edit list.\n";
+                return false;
+            }
+            newSize = newSize - edit.oldLen + edit.text.size();
+        }
+        if (edits.empty()) {
+            return true;
+        }
+        // Edits far enough apart that the updates for one cannot read back
+        // into the one before start a cluster of their own.
+        std::vector<size_t> clusters(1, 0);  // first edit of each cluster
+        for (size_t i = 1; i < edits.size(); i++) {
+            size_t previousEnd = edits[i - 1].pos + edits[i - 1].oldLen;
+            if (edits[i].pos - previousEnd >= EDIT_CLUSTER_GAP && updateReach(edits[i].pos) >= previousEnd) {
+                clusters.push_back(i);
+            }
+        }
+        careTaker.saveState(data, size, capacity);
+        size_t newCapacity = std::max(capacity, newSize + 1);
+        TextBuffer newBuffer(newCapacity);
+        char* newData = newBuffer.data();
+        size_t from = 0;
+        size_t to = 0;
+        for (auto &edit : edits) {
+            std::memcpy(newData + to, data + from, edit.pos - from);
+            to += edit.pos - from;
+            std::memcpy(newData + to, edit.text.data(), edit.text.size());
+            to += edit.text.size();
+            from = edit.pos + edit.oldLen;
+        }
+        std::memcpy(newData + to, data + from, size - from);
+        size_t oldSize = size;
+        buffer = std::move(newBuffer);
+        data = newData;
+        size = newSize;
+        capacity = newCapacity;
+        data[size] = '\0';
+
+        // The indexes take one cluster at a time, the last first, so the
+        // text before each cluster is still the old text they know. They see
+        // the text as it is after the cluster: from the end of the cluster
+        // before on, that is the new text moved back by the growth of the
+        // clusters before it.
+        ptrdiff_t shift = static_cast<ptrdiff_t>(newSize) - static_cast<ptrdiff_t>(oldSize);
+        for (size_t c = clusters.size(); c-- > 0;) {
+            size_t end = c + 1 < clusters.size() ? clusters[c + 1] : edits.size();
+            size_t begin = edits[clusters[c]].pos;
+            size_t oldLen = edits[end - 1].pos + edits[end - 1].oldLen - begin;
+            size_t newLen = oldLen;
+            for (size_t i = clusters[c]; i < end; i++) {
+                newLen = newLen - edits[i].oldLen + edits[i].text.size();
+            }
+            shift -= static_cast<ptrdiff_t>(newLen) - static_cast<ptrdiff_t>(oldLen);
+            onEdit(data + shift, size - shift, begin, oldLen, newLen);
+        }
+        // Later edits first, so each step's position is not moved by the others.
+        for (size_t i = edits.size(); recording && i-- > 0;) {
+            addMacroStep(false, edits[i].pos, edits[i].oldLen, edits[i].text);
+        }
+        return true;
+    }
+
+    // Resolves every hunk against the current text through the line index
+    // (allowing the hunk to have drifted a few lines), then applies them all
+    // as one edit.
+    void applyPatch(const std::string& filename) {
+        std::ifstream inFile(filename);
+        if (!inFile.is_open()) {
+            std::cout << "Failed to load from " << filename << std::endl;
+            return;
+        }
+        std::string patch((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+        std::vector<PatchHunk> hunks;
+        std::string error;
+        if (!parseUnifiedDiff(patch, hunks, error)) {
+            std::cout << error << std::endl;
+            return;
+        }
+        std::vector<TextEdit> edits;
+        long drift = 0;
+        for (size_t i = 0; i < hunks.size(); i++) {
+            std::string oldText = hunks[i].oldText();
+            std::string newText = hunks[i].newText();
+            size_t line = hunks[i].oldCount == 0 ? hunks[i].oldStart : hunks[i].oldStart - 1;
+            size_t pos = size + 1;
+            for (long shift = 0; shift <= MAX_PATCH_DRIFT && pos > size; shift = shift <= 0 ? 1 - shift : -shift) {
+                long candidate = static_cast<long>(line) + drift + shift;
+                if (candidate < 0 || candidate > static_cast<long>(textIndex->lineCount())) {
+                    continue;
+                }
+                size_t start = textIndex->lineStart(data, size, candidate);
+                size_t minStart = edits.empty() ? 0 : edits.back().pos + edits.back().oldLen;
+                if (start >= minStart && oldText.size() <= size - start && std::memcmp(data + start, oldText.data(), oldText.size()) == 0) {
+                    pos = start;
+                    drift += shift;
+                }
+            }
+            if (pos > size) {
+                std::cout << "Hunk " << i + 1 << " does not apply.\n";
+                return;
+            }
+            // Leave the unchanged context out of the edit.
+            size_t prefix = commonPrefix(oldText.data(), newText.data(), std::min(oldText.size(), newText.size()));
+            size_t suffix = commonSuffix(oldText.data() + oldText.size(), newText.data() + newText.size(),
+                                         std::min(oldText.size(), newText.size()) - prefix);
+            // Byte-wise trimming can stop inside a character that changed, like é to É.
+            auto splits = [](const std::string& text, size_t at) {
+                return at < text.size() && isContinuationByte(text[at]);
+            };
+            while (prefix > 0 && (splits(oldText, prefix) || splits(newText, prefix))) {
+                prefix--;
+            }
+            while (suffix > 0 && (splits(oldText, oldText.size() - suffix) || splits(newText, newText.size() - suffix))) {
+                suffix--;
+            }
+            edits.push_back({pos + prefix, oldText.size() - prefix - suffix,
+                             newText.substr(prefix, newText.size() - prefix - suffix)});
+        }
+        if (applyEdits(edits)) {
+            std::cout << "Applied " << hunks.size() << " hunks from " << filename << std::endl;
+        }
+    }
+
+    // Brings in changes made to the file on disk since we last loaded or
+    // saved it, keeping local edits and undo history. Both the disk version
+    // and the live text are diffed against the text we last loaded or saved;
+    // the disk hunks that do not touch a local change are moved to their
+    // place in the live text and applied as one edit. Hunks that overlap a
+    // local change are skipped and the local version is kept.
+    void reloadFromDisk() {
+        if (!diskState.valid) {
+            std::cout << "No file to reload.\n";
+            return;
+        }
+        std::string path = diskState.path;
+        DynamicArray fresh;
+        bool compressed = hasCompressedMagic(path) && fresh.readCompressedFile(path);
+        if (!compressed && !fresh.readFileParallel(path)) {
+            std::cout << "Failed to load from " << path << std::endl;
+            return;
+        }
+        std::string disk = diskText.str();
+        LineDiff external(disk.data(), disk.size(), fresh.data, fresh.size, 0, 0, &*fresh.textIndex);
+        LineDiff local(disk.data(), disk.size(), data, size, 0, 0, &*textIndex);
+        const std::vector<DiffHunk>& localHunks = local.hunks();
+
+        std::vector<TextEdit> edits;
+        size_t conflicts = 0;
+        size_t next = 0;
+        long lineShift = 0;
+        for (auto &hunk : external.hunks()) {
+            bool conflict = false;
+            for (; next < localHunks.size(); next++) {
+                const DiffHunk& mine = localHunks[next];
+                size_t mineEnd = mine.oldStart + mine.oldCount;
+                size_t hunkEnd = hunk.oldStart + hunk.oldCount;
+                bool touching = mineEnd == hunk.oldStart || hunkEnd == mine.oldStart;
+                if (mine.oldStart <= hunkEnd && hunk.oldStart <= mineEnd && !(touching && mine.oldCount > 0 && hunk.oldCount > 0)) {
+                    conflict = true;
+                    break;
+                }
+                if (mineEnd > hunk.oldStart) {
+                    break;
+                }
+                lineShift += static_cast<long>(mine.newCount) - static_cast<long>(mine.oldCount);
+            }
+            size_t oldBegin = external.oldOffset(hunk.oldStart);
+            size_t oldEnd = external.oldOffset(hunk.oldStart + hunk.oldCount);
+            size_t pos = textIndex->lineStart(data, size, hunk.oldStart + lineShift);
+            if (conflict || oldEnd - oldBegin > size - pos || std::memcmp(data + pos, disk.data() + oldBegin, oldEnd - oldBegin) != 0) {
+                conflicts++;
+                continue;
+            }
+            size_t newBegin = external.newOffset(hunk.newStart);
+            size_t newEnd = external.newOffset(hunk.newStart + hunk.newCount);
+            edits.push_back({pos, oldEnd - oldBegin, std::string(fresh.data + newBegin, newEnd - newBegin)});
+        }
+        if (!applyEdits(edits)) {
+            return;
+        }
+        diskText = ChunkedText::store(fresh.data, fresh.size, &diskText);
+        setDiskBlocks(fresh.textIndex->allBlocks());
+        diskState.read(path);
+        diskState.compressed = compressed;
+        if (conflicts > 0) {
+            // The skipped disk hunks differ from the live text where nothing is marked dirty.
+            dirty.markAll();
+        }
+        std::cout << "Merged " << edits.size() << " changes from " << path;
+        if (conflicts > 0) {
+            std::cout << ", kept local text for " << conflicts << " conflicting changes";
+        }
+        std::cout << std::endl;
+    }
+
+    void showChangesSinceDisk() const {
+        size_t prefix;
+        size_t suffix;
+        equalToDisk(prefix, suffix);
+        std::string disk = diskText.str();
+        LineDiff(disk.data(), disk.size(), data, size, prefix, suffix, &*textIndex).printUnified(std::cout, "on disk", "current");
+    }
+
+    // Compares the text with the file by block hashes, reading the file
+    // once; reports the first line that differs.
+    void verifyFile(const std::string& filename) const {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            std::cout << "Failed to open " << filename << std::endl;
+            return;
+        }
+        size_t fileSize = info.st_size;
+        void* mapped = fileSize > 0 ? mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            std::cout << "Failed to read " << filename << std::endl;
+            return;
+        }
+        const char* text = static_cast<const char*>(mapped);
+        const std::vector<TextBlock>& blocks = textIndex->allBlocks();
+        std::vector<size_t> starts(blocks.size() + 1, 0);
+        for (size_t i = 0; i < blocks.size(); i++) {
+            starts[i + 1] = starts[i] + blocks[i].length;
+        }
+        std::atomic<size_t> firstBad(SIZE_MAX);
+        parallelFor(blocks.size(), [&](size_t i) {
+            size_t end = std::min(fileSize, starts[i + 1]);
+            if (starts[i + 1] > fileSize || hashBytes(text + starts[i], end - starts[i]) != blocks[i].hash) {
+                size_t seen = firstBad.load();
+                while (i < seen && !firstBad.compare_exchange_weak(seen, i)) {
+                }
+            }
+        });
+        size_t bad = firstBad.load();
+        if (bad == SIZE_MAX && fileSize == size) {
+            std::cout << filename << " matches the text." << std::endl;
+        } else {
+            size_t from = bad == SIZE_MAX ? size : starts[bad];
+            size_t differs = from + commonPrefix(data + from, text + std::min(from, fileSize), std::min(size, fileSize) - std::min(from, fileSize));
+            std::cout << filename << " differs from the text at line " << textIndex->lineOf(data, differs) + 1 << std::endl;
+        }
+        if (mapped) {
+            munmap(mapped, fileSize);
+        }
+    }
+
+    // Depth 0 is the current text, 1 the most recent undo state, and so on.
+    void showChangesBetweenUndoStates(size_t older, size_t newer) const {
+        const Memento* olderState = careTaker.peekUndo(older);
+        const Memento* newerState = careTaker.peekUndo(newer);
+        if ((older != 0 && !olderState) || (newer != 0 && !newerState)) {
+            std::cout << "No such undo state.\n";
+            return;
+        }
+        std::string olderText = olderState ? olderState->savedText.str() : std::string(data, size);
+        std::string newerText = newerState ? newerState->savedText.str() : std::string(data, size);
+        LineDiff(olderText.data(), olderText.size(), newerText.data(), newerText.size())
+            .printUnified(std::cout, "undo state " + std::to_string(older), "undo state " + std::to_string(newer));
+    }
+
+    // Compares the bytes the history, clipboard and disk copy would take if
+    // stored whole with what the shared chunk store holds for all documents.
+    void showChunkStorage() const {
+        size_t referenced = clipboard.size() + diskText.size();
+        for (auto stack : {&careTaker.undoStates(), &careTaker.redoStates()}) {
+            for (auto memento : *stack) {
+                referenced += memento->savedText.size();
+            }
+        }
+        size_t chunks;
+        size_t stored;
+        ChunkStore::shared().usage(chunks, stored);
+        std::cout << "History, clipboard and disk copy: " << referenced << " bytes\n"
+                  << "Chunk store: " << stored << " bytes in " << chunks << " chunks" << std::endl;
+    }
+
+    void showByteChangesSinceDisk() const {
+        std::string disk = diskText.str();
+        std::vector<DiffHunk> hunks = diffBytes(disk.data(), disk.size(), data, size);
+        if (hunks.empty()) {
+            std::cout << "No changes." << std::endl;
+        }
+        for (auto &hunk : hunks) {
+            std::cout << "@@ -" << hunk.oldStart << "," << hunk.oldCount << " +" << hunk.newStart << "," << hunk.newCount << " @@\n"
+                      << "-" << std::string_view(disk.data() + hunk.oldStart, hunk.oldCount) << "\n"
+                      << "+" << std::string_view(data + hunk.newStart, hunk.newCount) << std::endl;
+        }
+    }
+
+    // Times the old iostream path against both FileIO backends on the given
+    // file. The file is loaded once untimed, so every backend reads from a
+    // warm page cache. Each load and save then runs BENCH_RUNS times, with
+    // the backends taking turns to go first, and the median is reported.
+    // The FileIO load numbers include UTF-8 validation, indexing and
+    // checksumming.
+    static void benchmarkIO(const std::string& filename) {
+        static constexpr size_t BENCH_RUNS = 5;
+        const char* names[6] = {"iostream load", "io_uring load", "thread pool load",
+                                "iostream save", "io_uring save", "thread pool save"};
+        DynamicArray warm;
+        if (!warm.readFileParallel(filename)) {
+            std::cout << "Failed to load from " << filename << std::endl;
+            return;
+        }
+        std::string scratch = filename + ".bench";
+        auto runBackend = [&](size_t which) {
+            switch (which) {
+                case 0: {
+                    std::ifstream inFile(filename);
+                    std::string content((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+                    return inFile.is_open() && content.size() == warm.size;
+                }
+                case 1:
+                    return DynamicArray().readFileParallel(filename, FileIO::IO_URING);
+                case 2:
+                    return DynamicArray().readFileParallel(filename, FileIO::THREAD_POOL);
+                case 3: {
+                    std::ofstream outFile(scratch);
+                    outFile.write(warm.data, warm.size);
+                    outFile.close();
+                    return !outFile.fail();
+                }
+                case 4:
+                    return warm.writeFileParallel(scratch, FileIO::IO_URING);
+                default:
+                    return warm.writeFileParallel(scratch, FileIO::THREAD_POOL);
+            }
+        };
+
+        std::vector<double> times[6];
+        bool ok[6] = {true, true, true, true, true, true};
+        for (size_t run = 0; run < BENCH_RUNS; run++) {
+            for (size_t group : {0, 3}) {
+                for (size_t turn = 0; turn < 3; turn++) {
+                    size_t which = group + (run + turn) % 3;
+                    auto start = std::chrono::steady_clock::now();
+                    ok[which] = runBackend(which) && ok[which];
+                    times[which].push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+                }
+            }
+        }
+        unlink(scratch.c_str());
+        for (size_t which = 0; which < 6; which++) {
+            if (!ok[which]) {
+                std::cout << names[which] << ": failed\n";
+                continue;
+            }
+            std::sort(times[which].begin(), times[which].end());
+            double ms = times[which][BENCH_RUNS / 2];
+            std::cout << names[which] << ": " << ms << " ms (" << (ms > 0 ? warm.size / 1048.576 / ms : 0) << " MB/s), median of "
+                      << BENCH_RUNS << "\n";
+        }
+    }
+
+    void insertWithReplacement(size_t line, size_t index, const char* text) {
+        size_t pos = positionOf(line, index);
+
+        size_t endPos = pos > size ? pos : scanWordBoundary(data, pos, size, true);
+
+        size_t replaceLen = endPos - pos;
+        insertAndReplace(pos, text, replaceLen);
+    }
+};
+
+// Self-checks, run with --self-check. Each one takes generated input through
+// a fast path and compares the result with the input itself or with a plain
+// reference. The editor's own messages are captured and shown only for a
+// failed check.
+class SelfCheck {
+private:
+    std::mt19937 random{20261017};
+    std::string directory;
+    std::ostringstream log;
+    size_t failures = 0;
+
+    bool expect(bool ok, const std::string& what) {
+        if (!ok) {
+            failures++;
+            std::cerr << "FAILED: " << what << "\n" << log.str() << std::endl;
+        }
+        log.str("");
+        return ok;
+    }
+
+    std::string path(const std::string& name) const {
+        return directory + "/" + name;
+    }
+
+    static void writeFile(const std::string& filename, const std::string& text) {
+        std::ofstream outFile(filename, std::ios::binary);
+        outFile << text;
+    }
+
+    static bool hasText(const DynamicArray& document, const std::string& text) {
+        return document.getSize() == text.size() && std::memcmp(document.getText(), text.data(), text.size()) == 0;
+    }
+
+    // Pieces drawn from the given ones; count is the number of pieces.
+    std::string randomText(const std::vector<std::string>& pieces, size_t count) {
+        std::string text;
+        for (size_t i = 0; i < count; i++) {
+            text += pieces[random() % pieces.size()];
+        }
+        return text;
+    }
+
+    // Lines of words, with some runs repeated so the codec finds matches.
+    std::string randomLines(size_t bytes) {
+        static const std::vector<std::string> words = {"alpha ", "beta ", "gamma ", "δέλτα ", "эпсилон ", "z", "\n", "\t", "{", "}"};
+        std::string text;
+        while (text.size() < bytes) {
+            if (text.size() > 64 && random() % 4 == 0) {
+                size_t from = random() % (text.size() - 32);
+                text.append(text, from, 16 + random() % 16);
+            } else {
+                text += words[random() % words.size()];
+            }
+        }
+        return text;
+    }
+
+    // Whether the index of the loaded document counts what a sequential
+    // build over the text counts, in total and at each of the positions.
+    static bool indexMatches(const DynamicArray& document, const std::string& text, const std::vector<size_t>& positions) {
+        TextIndex reference;
+        reference.build(text.data(), text.size());
+        const TextIndex& index = *document.textIndex;
+        const TextBlock& loaded = index.summary();
+        const TextBlock& expected = reference.summary();
+        bool ok = loaded.newlines == expected.newlines && loaded.words == expected.words
+                  && loaded.codepoints == expected.codepoints && index.lineCount() == reference.lineCount();
+        for (size_t pos : positions) {
+            ok = ok && index.lineOf(document.data, pos) == reference.lineOf(text.data(), pos)
+                 && index.wordsBefore(document.data, pos) == reference.wordsBefore(text.data(), pos)
+                 && index.charOffset(document.data, pos) == reference.charOffset(text.data(), pos);
+        }
+        return ok;
+    }
+
+    // The loader validates and indexes each FileIO chunk on its own and then
+    // joins them. Each case puts a character, a word or line breaks across
+    // the first chunk boundary at every offset and compares the UTF-8 verdict
+    // and the counts with a plain scan.
+    void chunkBoundaries() {
+        static const std::vector<std::string> fillers = {"alpha ", "beta\n", "x", "  ", "{", "}"};
+        static const std::vector<std::pair<std::string, bool>> cases = {
+            {"€", true}, {"a😀b", true}, {"word", true}, {" \n\n x", true}, {"\n", true},
+            {"\xe2\x82x", false}, {"ab\x82", false}, {"\xf0\x9f\x98", false}};
+        std::string head = randomText(fillers, FileIO::CHUNK_SIZE / 2);
+        std::string tail = randomText(fillers, 4096);
+        for (auto &entry : cases) {
+            for (size_t shift = 0; shift <= entry.first.size(); shift++) {
+                std::string text = head.substr(0, FileIO::CHUNK_SIZE - shift) + entry.first + tail;
+                writeFile(path("chunks.txt"), text);
+                DynamicArray document;
+                document.loadFromFile(path("chunks.txt"));
+                bool warned = log.str().find("not valid UTF-8") != std::string::npos;
+                std::vector<size_t> positions;
+                for (size_t pos = FileIO::CHUNK_SIZE - 8; pos <= FileIO::CHUNK_SIZE + 8; pos++) {
+                    positions.push_back(pos);
+                }
+                positions.push_back(text.size());
+                expect(hasText(document, text) && warned != entry.second && indexMatches(document, text, positions),
+                       "loading " + std::to_string(entry.first.size()) + " bytes " + std::to_string(shift)
+                       + " before a chunk boundary");
+            }
+        }
+        unlink(path("chunks.txt").c_str());
+    }
+
+    // Both FileIO backends must deliver the same bytes and index. Where
+    // io_uring is unavailable only the thread pool is checked.
+    void loaderBackends() {
+        std::string text = randomLines(3 * FileIO::CHUNK_SIZE + 12345);
+        writeFile(path("backends.txt"), text);
+        std::vector<size_t> positions;
+        for (size_t i = 0; i < 200; i++) {
+            positions.push_back(random() % (text.size() + 1));
+        }
+        DynamicArray pooled;
+        expect(pooled.readFileParallel(path("backends.txt"), FileIO::THREAD_POOL) && hasText(pooled, text)
+               && indexMatches(pooled, text, positions), "loading through the thread pool");
+        DynamicArray ring;
+        if (ring.readFileParallel(path("backends.txt"), FileIO::IO_URING)) {
+            expect(hasText(ring, text) && indexMatches(ring, text, positions), "loading through io_uring");
+        } else {
+            std::cerr << "     (io_uring is unavailable; only the thread pool was checked)" << std::endl;
+        }
+        unlink(path("backends.txt").c_str());
+    }
+
+    void compressedRoundTrip() {
+        for (std::string raw : {std::string(), std::string(100000, 'x'), std::string("abc"), randomText({"a", "b", "cd"}, 5000)}) {
+            std::string frame;
+            LzCodec::compressFrame(raw.data(), raw.size(), frame);
+            uint32_t rawLen, storedLen;
+            std::memcpy(&rawLen, frame.data(), 4);
+            std::memcpy(&storedLen, frame.data() + 4, 4);
+            std::string back(rawLen, '\0');
+            expect(rawLen == raw.size() && storedLen == frame.size() - LzCodec::FRAME_HEADER_SIZE
+                   && LzCodec::decompressFrame(frame.data() + LzCodec::FRAME_HEADER_SIZE, storedLen, &back[0], rawLen) && back == raw,
+                   "LZ frame round trip of " + std::to_string(raw.size()) + " bytes");
+        }
+        for (size_t size : {size_t(0), size_t(1), LzCodec::CHUNK_SIZE, 2 * LzCodec::CHUNK_SIZE + 17}) {
+            std::string text = randomLines(size);
+            text.resize(size);
+            writeFile(path("plain.txt"), text);
+            DynamicArray original;
+            original.loadFromFile(path("plain.txt"));
+            original.saveToFile(path("packed.lzc"));
+            DynamicArray loaded;
+            loaded.loadFromFile(path("packed.lzc"));
+            expect(hasText(loaded, text), "compressed file round trip of " + std::to_string(size) + " bytes");
+        }
+        unlink(path("plain.txt").c_str());
+        unlink(path("packed.lzc").c_str());
+    }
+
+    void patchRoundTrip() {
+        static const std::vector<std::string> lines = {"int main() {\n", "    return 0;\n", "}\n", "\n", "ünïcödé\n", "// Σχόλιο\n", "x\n"};
+        for (int round = 0; round < 40; round++) {
+            std::vector<std::string> oldLines;
+            for (size_t i = random() % 200; i > 0; i--) {
+                oldLines.push_back(lines[random() % lines.size()]);
+            }
+            std::vector<std::string> newLines = oldLines;
+            for (size_t edits = 1 + random() % 6; edits > 0; edits--) {
+                size_t at = random() % (newLines.size() + 1);
+                if (at < newLines.size() && random() % 2 == 0) {
+                    newLines.erase(newLines.begin() + at);
+                } else {
+                    newLines.insert(newLines.begin() + at, "line " + std::to_string(random() % 1000) + "\n");
+                }
+            }
+            std::string oldText, newText;
+            for (auto &line : oldLines) {
+                oldText += line;
+            }
+            for (auto &line : newLines) {
+                newText += line;
+            }
+            if (round % 4 == 1 && !oldText.empty()) {
+                oldText.pop_back();
+            }
+            if (round % 4 == 2 && !newText.empty()) {
+                newText.pop_back();
+            }
+            if (oldText == newText) {
+                continue;
+            }
+            std::ostringstream patch;
+            LineDiff(oldText.data(), oldText.size(), newText.data(), newText.size()).printUnified(patch, "old", "new");
+            std::vector<PatchHunk> hunks;
+            std::string error;
+            if (!expect(parseUnifiedDiff(patch.str(), hunks, error) && !hunks.empty(), "parsing a printed diff: " + error)) {
+                continue;
+            }
+            writeFile(path("old.txt"), oldText);
+            writeFile(path("change.patch"), patch.str());
+            DynamicArray document;
+            document.loadFromFile(path("old.txt"));
+            document.applyPatch(path("change.patch"));
+            expect(hasText(document, newText), "applying a printed diff, round " + std::to_string(round));
+        }
+        unlink(path("old.txt").c_str());
+        unlink(path("change.patch").c_str());
+    }
+
+    // Whether the pattern matches at pos, folding and testing word bounds
+    // one character at a time.
+    static bool matchesAt(const std::string& text, size_t pos, const std::string& pattern, SearchOptions options) {
+        auto p = reinterpret_cast<const unsigned char*>(text.data());
+        auto q = reinterpret_cast<const unsigned char*>(pattern.data());
+        size_t i = 0;
+        while (i < pattern.size()) {
+            if (pos + i >= text.size()) {
+                return false;
+            }
+            int textLen, patternLen;
+            uint32_t a = options.ignoreCase ? foldedCharAt(p + pos + i, p + text.size(), textLen) : p[pos + i];
+            uint32_t b = options.ignoreCase ? foldedCharAt(q + i, q + pattern.size(), patternLen) : q[i];
+            if (!options.ignoreCase) {
+                textLen = patternLen = 1;
+            }
+            if (a != b || textLen != patternLen || i + patternLen > pattern.size()) {
+                return false;
+            }
+            i += patternLen;
+        }
+        if (options.wholeWord) {
+            if (pos > 0 && isSearchWordChar(p[pos - 1])) {
+                return false;
+            }
+            if (pos + i < text.size() && isSearchWordChar(p[pos + i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void searchModes() {
+        static const std::vector<std::string> pieces = {"a", "A", "b", "B", "z", "Z", " ", "\n", "_", "1", "-",
+                                                        "é", "É", "σ", "Σ", "ς", "ά", "Ά", "д", "Д", "€"};
+        static const std::map<std::string, std::string> otherCase = {{"a", "A"}, {"A", "a"}, {"b", "B"}, {"B", "b"}, {"z", "Z"},
+                                                                     {"Z", "z"}, {"é", "É"}, {"É", "é"}, {"σ", "Σ"}, {"Σ", "ς"},
+                                                                     {"ς", "σ"}, {"ά", "Ά"}, {"Ά", "ά"}, {"д", "Д"}, {"Д", "д"}};
+        for (int round = 0; round < 200; round++) {
+            std::vector<std::string> textPieces;
+            std::string text;
+            for (size_t i = 20 + random() % 300; i > 0; i--) {
+                textPieces.push_back(pieces[random() % pieces.size()]);
+                text += textPieces.back();
+            }
+            std::string pattern;
+            size_t from = random() % textPieces.size();
+            for (size_t i = from; i < std::min(textPieces.size(), from + 1 + random() % 4); i++) {
+                auto other = otherCase.find(textPieces[i]);
+                pattern += other != otherCase.end() && random() % 2 ? other->second : textPieces[i];
+            }
+            for (int mode = 0; mode < 4; mode++) {
+                SearchOptions options;
+                options.ignoreCase = mode & 1;
+                options.wholeWord = mode & 2;
+                std::vector<size_t> expected;
+                for (size_t pos = 0; pos < text.size(); pos++) {
+                    if (matchesAt(text, pos, pattern, options)) {
+                        expected.push_back(pos);
+                    }
+                }
+                SearchPattern search(pattern, options);
+                std::vector<size_t> forward;
+                for (size_t pos = search.find(text.data(), text.size(), 0); pos != SearchPattern::npos;
+                     pos = search.find(text.data(), text.size(), pos + 1)) {
+                    forward.push_back(pos);
+                }
+                std::vector<size_t> backward;
+                for (size_t pos = search.rfind(text.data(), text.size(), text.size()); pos != SearchPattern::npos;
+                     pos = search.rfind(text.data(), text.size(), pos)) {
+                    backward.insert(backward.begin(), pos);
+                }
+                expect(forward == expected && backward == expected,
+                       "search for \"" + pattern + "\" in mode " + std::to_string(mode) + ", round " + std::to_string(round));
+            }
         }
-        std::memmove(data + pos, data + pos + len, size - pos - len);
-        size -= len;
-        data[size] = '\0';
     }
 
-    void cutText(size_t pos, size_t len) {
-        careTaker.saveState(data, size, capacity);
-        if (pos >= size || pos + len > size) {
-            std::cout << "Invalid position or length.\n";
-            return;
+    void sessionRoundTrip() {
+        writeFile(path("session.txt"), randomLines(3 * 1024 * 1024));
+        DynamicArray original;
+        original.loadFromFile(path("session.txt"));
+        std::vector<std::string> states(1, std::string(original.getText(), original.getSize()));
+        for (int i = 0; i < 12; i++) {
+            size_t pos = random() % original.getSize();
+            while (!original.isCharBoundary(pos)) {
+                pos--;
+            }
+            if (i % 3 == 2) {
+                size_t end = std::min(original.getSize(), pos + 1 + random() % 5000);
+                while (!original.isCharBoundary(end)) {
+                    end++;
+                }
+                original.deleteText(pos, end - pos);
+            } else {
+                original.insertAndReplace(pos, randomText({"x", "ü", "\n", "Σ"}, 1 + random() % 100).c_str(), 0);
+            }
+            states.emplace_back(original.getText(), original.getSize());
         }
-        copyText(pos, len);
-        deleteText(pos, len);
-    }
+        for (int i = 0; i < 3; i++) {
+            original.undo();
+        }
+        size_t current = states.size() - 4;
+        size_t copied = 1000;
+        while (!original.isCharBoundary(copied)) {
+            copied--;
+        }
+        original.copyText(0, copied);
+        original.saveSession(path("editor.session"));
 
-    void copyText(size_t pos, size_t len) {
-        if (pos >= size || pos + len > size) {
-            std::cout << "Invalid position or length.\n";
-            return;
+        DynamicArray loaded;
+        loaded.loadSession(path("editor.session"));
+        bool ok = hasText(loaded, states[current]);
+        for (size_t i = current + 1; ok && i < states.size(); i++) {
+            loaded.redo();
+            ok = hasText(loaded, states[i]);
         }
-        clipboard.assign(data + pos, len);
+        for (size_t i = states.size() - 1; ok && i-- > 0;) {
+            loaded.undo();
+            ok = hasText(loaded, states[i]);
+        }
+        loaded.pasteText(0);
+        ok = ok && hasText(loaded, states[current].substr(0, copied) + states[0]);
+        expect(ok, "session round trip");
+        unlink(path("session.txt").c_str());
+        unlink(path("editor.session").c_str());
     }
 
-    void pasteText(size_t pos) {
-        careTaker.saveState(data, size, capacity);
-        if (pos > size) {
-            std::cout << "Invalid position.\n";
-            return;
+    // A truncated or damaged session file must be refused and leave the
+    // document as it was.
+    void damagedSessions() {
+        DynamicArray original;
+        original.insertAndReplace(0, randomLines(200000).c_str(), 0);
+        original.deleteText(100, 5000);
+        original.undo();
+        original.saveSession(path("damaged.session"));
+        std::ifstream inFile(path("damaged.session"), std::ios::binary);
+        std::string saved((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+        const size_t header = 4 + 8 * sizeof(uint64_t);
+        std::vector<std::pair<std::string, std::string>> variants;
+        for (size_t length : {size_t(0), size_t(3), header - 1, header, header + 8, saved.size() / 2, saved.size() - 1}) {
+            variants.emplace_back("truncated to " + std::to_string(length) + " bytes", saved.substr(0, length));
         }
-        insertAndReplace(pos, clipboard.c_str(), 0);
+        // Fields 1 to 6 are the text size and the block, undo, redo, chunk
+        // and list word counts.
+        for (size_t field = 1; field <= 6; field++) {
+            for (uint64_t value : {UINT64_MAX, UINT64_MAX / 2 + 1, uint64_t(1) << 40}) {
+                std::string damaged = saved;
+                std::memcpy(&damaged[4 + field * sizeof(uint64_t)], &value, sizeof(value));
+                variants.emplace_back("header field " + std::to_string(field) + " set to " + std::to_string(value), damaged);
+            }
+        }
+        // Undo and redo counts whose sum wraps around to zero.
+        std::string wrapped = saved;
+        for (uint64_t value : {UINT64_MAX, uint64_t(1)}) {
+            size_t field = value == 1 ? 4 : 3;
+            std::memcpy(&wrapped[4 + field * sizeof(uint64_t)], &value, sizeof(value));
+        }
+        variants.emplace_back("undo and redo counts that wrap around", wrapped);
+        std::string flipped = saved;
+        flipped[saved.size() / 3] ^= 0x20;
+        variants.emplace_back("a flipped byte in the chunk data", flipped);
+
+        for (auto &variant : variants) {
+            writeFile(path("damaged.session"), variant.second);
+            DynamicArray document;
+            document.insertAndReplace(0, "unchanged", 0);
+            document.loadSession(path("damaged.session"));
+            bool refused = log.str().find("Failed to load session") != std::string::npos;
+            expect(refused && hasText(document, "unchanged"), "loading a session file with " + variant.first);
+        }
+        unlink(path("damaged.session").c_str());
     }
 
-    void undo() {
-        // Save the current state to the redo stack before undoing
-        careTaker.pushToRedo(data, size, capacity);
-        Memento* memento = careTaker.undo();
-        if (memento) {
-            if (capacity != memento->savedCapacity) {
-                resize(memento->savedCapacity);
+    static bool sameTokens(const DynamicArray& a, const DynamicArray& b, size_t line) {
+        std::vector<Token> x = a.syntax->tokens(a.data, a.size, *a.textIndex, line);
+        std::vector<Token> y = b.syntax->tokens(b.data, b.size, *b.textIndex, line);
+        if (x.size() != y.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < x.size(); i++) {
+            if (x[i].pos != y[i].pos || x[i].length != y[i].length || x[i].kind != y[i].kind) {
+                return false;
             }
-            std::memcpy(data, memento->savedData, memento->savedSize);
-            size = memento->savedSize;
-            data[size] = '\0';
-        } else {
-            std::cout << "Cannot undo further.\n";
         }
+        return true;
     }
 
-    void redo() {
-        // Save the current state to the undo stack before redoing
-        careTaker.pushToUndo(data, size, capacity);
-        Memento* memento = careTaker.redo();
-        if (memento) {
-            if (capacity != memento->savedCapacity) {
-                resize(memento->savedCapacity);
+    // applyEdits updates the indexes one cluster of nearby edits at a time.
+    // After each batch the index, a cached search and the lexer states must
+    // agree with a document loaded from the resulting text.
+    void batchedEdits() {
+        static const std::vector<std::string> pieces = {"int x = 1;\n", "/* note\n", "*/\n", "{ call(x); }\n", "\"s\" ", "é ", "\n\n", "x"};
+        // One line is longer than the gap that separates clusters.
+        std::string text = randomText(pieces, 200000) + randomText({"x = 1; ", "/* a */ "}, 100000) + randomText(pieces, 200000);
+        writeFile(path("batch.txt"), text);
+        DynamicArray document;
+        document.loadFromFile(path("batch.txt"));
+        document.setSyntax("c");
+        SearchOptions wholeWord;
+        wholeWord.wholeWord = true;
+        document.findAll("x", wholeWord);
+        for (int round = 0; round < 12; round++) {
+            std::vector<size_t> cuts;
+            for (size_t i = 1 + random() % (round % 2 ? 60 : 16); i > 0; i--) {
+                size_t pos = random() % (text.size() + 1);
+                while (pos < text.size() && (text[pos] & 0xc0) == 0x80) {
+                    pos++;
+                }
+                cuts.push_back(pos);
             }
-            std::memcpy(data, memento->savedData, memento->savedSize);
-            size = memento->savedSize;
-            data[size] = '\0';
-        } else {
-            std::cout << "Cannot redo further.\n";
+            std::sort(cuts.begin(), cuts.end());
+            cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+            std::vector<TextEdit> edits;
+            std::vector<size_t> lines;
+            for (size_t i = 0; i + 1 < cuts.size(); i += 2) {
+                size_t end = random() % 3 == 0 ? std::min(cuts[i + 1], cuts[i] + random() % 100) : cuts[i];
+                while (end < text.size() && (text[end] & 0xc0) == 0x80) {
+                    end++;
+                }
+                edits.push_back({cuts[i], end - cuts[i], randomText(pieces, random() % 3)});
+                lines.push_back(document.textIndex->lineOf(document.data, cuts[i]));
+            }
+            for (size_t i = edits.size(); i-- > 0;) {
+                text.replace(edits[i].pos, edits[i].oldLen, edits[i].text);
+            }
+            bool ok = document.applyEdits(edits) && hasText(document, text);
+            writeFile(path("batch.txt"), text);
+            DynamicArray fresh;
+            fresh.loadFromFile(path("batch.txt"));
+            fresh.setSyntax("c");
+            std::vector<size_t> positions;
+            for (auto &edit : edits) {
+                positions.push_back(std::min(edit.pos, text.size()));
+            }
+            ok = ok && indexMatches(document, text, positions) && document.findAll("x", wholeWord) == fresh.findAll("x", wholeWord);
+            for (size_t i = 0; i < 300; i++) {
+                lines.push_back(random() % fresh.textIndex->lineCount());
+            }
+            for (size_t line : lines) {
+                ok = ok && (line >= fresh.textIndex->lineCount() || sameTokens(document, fresh, line));
+            }
+            expect(ok, "a batch of " + std::to_string(edits.size()) + " edits, round " + std::to_string(round));
         }
+        unlink(path("batch.txt").c_str());
     }
 
-    const char* getText() const {
-        return data;
+    // A long replay against the same edits made one run at a time. The
+    // macro edits behind its own first step, and the runs land on text of
+    // growing length, so the composer's piece list gets long.
+    void longReplay() {
+        const size_t runs = 32000;
+        std::string unit = "abcd";
+        std::string text;
+        for (size_t i = 0; i < runs; i++) {
+            text += unit;
+        }
+        DynamicArray document;
+        document.insertAndReplace(0, text.c_str(), 0);
+        document.startRecording(0);
+        document.insertAndReplace(4, "]", 0);
+        document.insertAndReplace(1, "XY", 1);
+        document.insertAndReplace(0, "[", 0);
+        document.stopRecording();
+        auto started = std::chrono::steady_clock::now();
+        document.replayMacro(runs - 1);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::string expected;
+        for (size_t i = 0; i < runs; i++) {
+            expected += "[aXYcd]";
+        }
+        expect(hasText(document, expected), "replaying a macro " + std::to_string(runs - 1) + " times");
+        expect(seconds < 1.0, "replaying a macro " + std::to_string(runs - 1) + " times took " + std::to_string(seconds) + " s");
     }
 
-    size_t findText(const char* search) const {
-        char* found = std::strstr(data, search);
-        return found ? found - data : -1;
+    static std::string readFile(const std::string& filename) {
+        std::ifstream inFile(filename, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
     }
 
-    void saveToFile(const std::string& filename) const {
-        std::ofstream outFile(filename);
-        if (outFile.is_open()) {
-            outFile << data;
-            outFile.close();
-            std::cout << "Saved to " << filename << std::endl;
-        } else {
-            std::cout << "Failed to save to " << filename << std::endl;
+    // Saves after a few edits patch the file, and update the disk copy and
+    // the sidecar from the dirty ranges. After each save the file and the
+    // disk copy must equal the text, and a load through the new sidecar must
+    // give the same index and UTF-8 verdict as a plain scan. A file changed
+    // in place under an unchanged stamp must be re-indexed.
+    void incrementalSaves() {
+        std::string text = randomText({"alpha ", "δέλτα ", "\n", "x"}, 3 * FileIO::CHUNK_SIZE / 5);
+        writeFile(path("saved.txt"), text);
+        DynamicArray document;
+        document.setIndexSidecar(true);
+        document.loadFromFile(path("saved.txt"));
+        for (int round = 0; round < 10; round++) {
+            std::vector<size_t> positions;
+            for (int i = 0; i < 4; i++) {
+                size_t pos = random() % text.size();
+                while (!document.isCharBoundary(pos)) {
+                    pos--;
+                }
+                std::string inserted = round == 5 && i == 0 ? "\xc3(" : randomText({"x", "é", "\n", " "}, 1 + random() % 20);
+                size_t replaced = 0;
+                if (i > 0 || round % 3 != 0) {
+                    // Same length, so the save can patch the file in place.
+                    replaced = std::min(inserted.size(), text.size() - pos);
+                    while (!document.isCharBoundary(pos + replaced)) {
+                        replaced--;
+                    }
+                }
+                document.insertAndReplace(pos, inserted.c_str(), replaced);
+                text.replace(pos, replaced, inserted);
+                positions.push_back(pos);
+            }
+            document.saveToFile(path("saved.txt"));
+            bool ok = readFile(path("saved.txt")) == text && document.diskText.str() == text && document.matchesDisk();
+            log.str("");
+            DynamicArray reloaded;
+            reloaded.setIndexSidecar(true);
+            reloaded.loadFromFile(path("saved.txt"));
+            bool warned = log.str().find("not valid UTF-8") != std::string::npos;
+            bool valid = validUtf8Around(text.data(), text.size(), 0, text.size());
+            expect(ok && hasText(reloaded, text) && indexMatches(reloaded, text, positions) && warned != valid,
+                   "incremental save, round " + std::to_string(round));
         }
+
+        struct stat info;
+        stat(path("saved.txt").c_str(), &info);
+        text[text.size() / 2] = text[text.size() / 2] == 'q' ? 'r' : 'q';
+        text[text.size() / 3] = '\n';
+        writeFile(path("saved.txt"), text);
+        struct timespec times[2] = {info.st_atim, info.st_mtim};
+        utimensat(AT_FDCWD, path("saved.txt").c_str(), times, 0);
+        DynamicArray changed;
+        changed.setIndexSidecar(true);
+        changed.loadFromFile(path("saved.txt"));
+        expect(hasText(changed, text) && indexMatches(changed, text, {text.size() / 3, text.size() / 2, text.size()}),
+               "loading a file changed under its sidecar stamp");
+        unlink(path("saved.txt").c_str());
+        unlink(DynamicArray::sidecarName(path("saved.txt")).c_str());
     }
 
-    void loadFromFile(const std::string& filename) {
-        std::ifstream inFile(filename);
-        if (inFile.is_open()) {
-            std::string content((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
-            delete[] data;
-            size = content.size();
-            capacity = size + 1;
-            data = new char[capacity];
-            std::strcpy(data, content.c_str());
-            inFile.close();
-            std::cout << "Loaded from " << filename << std::endl;
-        } else {
-            std::cout << "Failed to load from " << filename << std::endl;
+    // Slots two buffers map at the same place.
+    static size_t sharedSlots(const TextBuffer& a, const TextBuffer& b) {
+        size_t shared = 0;
+        for (size_t i = 0; i < std::min(a.slots.size(), b.slots.size()); i++) {
+            shared += a.slots[i] == b.slots[i];
         }
+        return shared;
     }
-    void insertWithReplacement(size_t line, size_t index, const char* text) {
-        careTaker.saveState(data, size, capacity);
-        size_t pos = 0;
-        while (line > 0 && pos < size) {
-            if (data[pos] == '\n') {
-                line--;
-            }
+
+    // Clones share their text slots and indexes until one side writes. A
+    // same-length edit must copy only the slot it writes, and edits on any
+    // of three related documents must leave the others as they were. The
+    // original is then dropped, so the slots only it held go back to the
+    // file, and documents loaded into them must not disturb the clones.
+    void cloneSharing() {
+        std::string text = randomText({"alpha ", "δέλτα ", "\n", "x"}, 5 * SlotFile::SLOT_BYTES / 5);
+        writeFile(path("clone.txt"), text);
+        auto original = std::make_unique<DynamicArray>();
+        original->loadFromFile(path("clone.txt"));
+        auto copy = original->clone();
+        bool memfd = !original->buffer.slots.empty();
+        size_t slots = original->buffer.slots.size();
+        expect(hasText(*copy, text) && (!memfd || sharedSlots(original->buffer, copy->buffer) == slots)
+               && &*copy->textIndex == &*original->textIndex && &*copy->syntax == &*original->syntax,
+               "a clone shares the text and indexes");
+
+        size_t pos = 2 * SlotFile::SLOT_BYTES + 100;
+        while (!copy->isCharBoundary(pos) || !copy->isCharBoundary(pos + 2)) {
             pos++;
         }
-        pos += index;
+        std::string copyText = text;
+        copy->insertAndReplace(pos, "ab", 2);
+        copyText.replace(pos, 2, "ab");
+        expect(hasText(*copy, copyText) && hasText(*original, text)
+               && (!memfd || sharedSlots(original->buffer, copy->buffer) == slots - 1)
+               && &*copy->textIndex != &*original->textIndex
+               && indexMatches(*original, text, {pos}) && indexMatches(*copy, copyText, {pos}),
+               "a same-length edit in a clone copies one slot");
 
-        size_t endPos = pos;
-        while (endPos < size && data[endPos] != ' ' && data[endPos] != '\n') {
-            endPos++;
+        auto third = copy->clone();
+        std::vector<DynamicArray*> documents = {original.get(), copy.get(), third.get()};
+        std::vector<std::string> texts = {text, copyText, copyText};
+        std::vector<std::string> previous = texts;
+        for (int round = 0; round < 27; round++) {
+            size_t d = round % documents.size();
+            DynamicArray& document = *documents[d];
+            previous[d] = texts[d];
+            size_t at = random() % texts[d].size();
+            while (!document.isCharBoundary(at)) {
+                at--;
+            }
+            if (round / 3 % 3 == 0) {
+                // Long enough to make the buffer grow.
+                std::string tail = randomText({"é", "tail\n"}, round == 2 ? SlotFile::SLOT_BYTES / 2 : 10);
+                document.append(tail.c_str());
+                texts[d] += tail;
+            } else if (round / 3 % 3 == 1) {
+                std::string inserted = randomText({"é", "y", "\n"}, 1 + random() % 50);
+                document.insertAndReplace(at, inserted.c_str(), 0);
+                texts[d].insert(at, inserted);
+            } else {
+                size_t end = std::min(texts[d].size(), at + 1 + random() % 1000);
+                while (!document.isCharBoundary(end)) {
+                    end++;
+                }
+                document.deleteText(at, end - at);
+                texts[d].erase(at, end - at);
+            }
+            bool ok = true;
+            for (size_t i = 0; i < documents.size(); i++) {
+                ok = ok && hasText(*documents[i], texts[i]);
+            }
+            expect(ok && indexMatches(document, texts[d], {at}), "edit of clone " + std::to_string(d) + ", round " + std::to_string(round));
         }
+        auto fourth = copy->clone();
+        bool ok = true;
+        for (size_t i = 0; i < documents.size(); i++) {
+            documents[i]->undo();
+            ok = ok && hasText(*documents[i], previous[i]);
+        }
+        expect(ok && hasText(*fourth, texts[1]), "undo in clones");
 
-        size_t replaceLen = endPos - pos;
-        insertAndReplace(pos, text, replaceLen);
+        original.reset();
+        DynamicArray reused;
+        reused.loadFromFile(path("clone.txt"));
+        reused.insertAndReplace(0, "z", 0);
+        auto reusedCopy = reused.clone();
+        reusedCopy->deleteText(0, 1000);
+        expect(hasText(*copy, previous[1]) && hasText(*third, previous[2]) && indexMatches(*copy, previous[1], {pos})
+               && indexMatches(*third, previous[2], {pos}),
+               "clones outliving their original");
+        unlink(path("clone.txt").c_str());
+    }
+
+public:
+    // Runs every check; true when all pass.
+    bool run() {
+        std::string base = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+        std::vector<char> name(base.begin(), base.end());
+        const std::string suffix = "/editor-check-XXXXXX";
+        name.insert(name.end(), suffix.begin(), suffix.end());
+        name.push_back('\0');
+        if (!mkdtemp(name.data())) {
+            std::cerr << "Cannot create a scratch directory in " << base << std::endl;
+            return false;
+        }
+        directory = name.data();
+        std::streambuf* console = std::cout.rdbuf(log.rdbuf());
+        std::pair<const char*, void (SelfCheck::*)()> checks[] = {
+            {"chunk boundaries", &SelfCheck::chunkBoundaries},
+            {"loader backends", &SelfCheck::loaderBackends},
+            {"compressed round trip", &SelfCheck::compressedRoundTrip},
+            {"patch round trip", &SelfCheck::patchRoundTrip},
+            {"search modes", &SelfCheck::searchModes},
+            {"session round trip", &SelfCheck::sessionRoundTrip},
+            {"damaged sessions", &SelfCheck::damagedSessions},
+            {"batched edits", &SelfCheck::batchedEdits},
+            {"long replay", &SelfCheck::longReplay},
+            {"incremental saves", &SelfCheck::incrementalSaves},
+            {"clone sharing", &SelfCheck::cloneSharing},
+        };
+        for (auto &check : checks) {
+            size_t before = failures;
+            (this->*check.second)();
+            std::cerr << (failures == before ? "ok   " : "FAIL ") << check.first << std::endl;
+        }
+        std::cout.rdbuf(console);
+        rmdir(directory.c_str());
+        std::cout << (failures == 0 ? "All self-checks passed." : "Some self-checks failed.") << std::endl;
+        return failures == 0;
     }
 };
 
@@ -267,13 +6319,57 @@ void menu_display() {
               << "13. Copy text\n"
               << "14. Paste text\n"
               << "15. Insert with replacement\n"
+              << "16. Benchmark file I/O\n"
+              << "17. Show line and column of position\n"
+              << "18. Count words\n"
+              << "19. Replace word by number\n"
+              << "20. Show next and previous word from position\n"
+              << "21. Show document statistics\n"
+              << "22. Show changes since last load or save\n"
+              << "23. Show changes between undo states\n"
+              << "24. Show byte-level changes since last load or save\n"
+              << "25. Apply patch file\n"
+              << "26. Reload file from disk, keeping local edits\n"
+              << "27. Find text, ignoring case or matching whole words\n"
+              << "28. Find several texts at once\n"
+              << "29. Find text allowing typos\n"
+              << "30. Find next and previous match from a position\n"
+              << "31. Find all matches\n"
+              << "32. Set syntax (c, ini or none)\n"
+              << "33. Show the tokens of a line\n"
+              << "34. Find the matching bracket\n"
+              << "35. Find the enclosing brackets of a position\n"
+              << "36. Sort lines\n"
+              << "37. Remove duplicate lines\n"
+              << "38. Keep or remove lines containing text\n"
+              << "39. Copy rectangular block\n"
+              << "40. Delete rectangular block\n"
+              << "41. Insert text at a column on a range of lines\n"
+              << "42. Paste clipboard as rectangular block\n"
+              << "43. Start recording macro\n"
+              << "44. Stop recording macro\n"
+              << "45. Replay macro N times\n"
+              << "46. Replay macro at every match\n"
+              << "47. Save session\n"
+              << "48. Load session\n"
+              << "49. Turn index sidecar files on or off\n"
+              << "50. Verify a file against the text\n"
+              << "51. Show chunk storage use\n"
+              << "52. Clone the document\n"
+              << "53. Switch document\n"
               << "0. Exit\n";
 }
 
-int main() {
-    DynamicArray arr;
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--self-check") {
+        return SelfCheck().run() ? 0 : 1;
+    }
+    std::vector<std::unique_ptr<DynamicArray>> documents;
+    documents.push_back(std::make_unique<DynamicArray>());
+    size_t current = 0;
 
     while (true) {
+        DynamicArray& arr = *documents[current];
         menu_display();
 
         int choice;
@@ -392,6 +6488,345 @@ int main() {
                 arr.insertWithReplacement(line, index, text.c_str());
                 break;
             }
+            case 16: {
+                std::cout << "Enter the filename to benchmark:\n";
+                std::string filename;
+                std::getline(std::cin, filename);
+                DynamicArray::benchmarkIO(filename);
+                break;
+            }
+            case 17: {
+                std::cout << "Enter the position:\n";
+                size_t pos, line, column;
+                std::cin >> pos;
+                std::cin.ignore();
+                if (pos > arr.getSize()) {
+                    std::cout << "Invalid position.\n";
+                    break;
+                }
+                arr.locate(pos, line, column);
+                std::cout << "Line " << line << ", column " << column << std::endl;
+                break;
+            }
+            case 18: {
+                std::cout << "Words: " << arr.wordCount() << std::endl;
+                break;
+            }
+            case 19: {
+                std::cout << "Enter the word number (starting from 0):\n";
+                size_t word;
+                std::cin >> word;
+                std::cin.ignore();
+                std::cout << "Enter the replacement text:\n";
+                std::string text;
+                std::getline(std::cin, text);
+                arr.replaceWord(word, text.c_str());
+                break;
+            }
+            case 20: {
+                std::cout << "Enter the position:\n";
+                size_t pos;
+                std::cin >> pos;
+                std::cin.ignore();
+                size_t next = arr.nextWord(pos);
+                size_t previous = arr.previousWord(pos);
+                if (next != arr.getSize()) {
+                    std::cout << "Next word at position " << next << std::endl;
+                } else {
+                    std::cout << "No next word." << std::endl;
+                }
+                if (previous != arr.getSize()) {
+                    std::cout << "Previous word at position " << previous << std::endl;
+                } else {
+                    std::cout << "No previous word." << std::endl;
+                }
+                break;
+            }
+            case 21: {
+                arr.printStats();
+                break;
+            }
+            case 22: {
+                arr.showChangesSinceDisk();
+                break;
+            }
+            case 23: {
+                std::cout << "Enter the older and newer undo depth (0 is the current text):\n";
+                size_t older, newer;
+                std::cin >> older >> newer;
+                std::cin.ignore();
+                arr.showChangesBetweenUndoStates(older, newer);
+                break;
+            }
+            case 24: {
+                arr.showByteChangesSinceDisk();
+                break;
+            }
+            case 25: {
+                std::cout << "Enter the patch filename:\n";
+                std::string filename;
+                std::getline(std::cin, filename);
+                arr.applyPatch(filename);
+                break;
+            }
+            case 26: {
+                arr.reloadFromDisk();
+                break;
+            }
+            case 27: {
+                std::cout << "Enter the text to find:\n";
+                std::string text;
+                std::getline(std::cin, text);
+                std::cout << "Enter 1 to ignore case and 1 to match whole words only (e.g. 1 0):\n";
+                SearchOptions options;
+                std::cin >> options.ignoreCase >> options.wholeWord;
+                std::cin.ignore();
+                size_t pos = arr.findText(text, options);
+                if (pos != SearchPattern::npos) {
+                    std::cout << "Found text at position " << pos << std::endl;
+                } else {
+                    std::cout << "Text not found." << std::endl;
+                }
+                break;
+            }
+            case 28: {
+                std::cout << "Enter the texts to find, one per line, then an empty line:\n";
+                std::vector<std::string> patterns;
+                std::string text;
+                while (std::getline(std::cin, text) && !text.empty()) {
+                    patterns.push_back(text);
+                }
+                std::vector<PatternMatch> matches = arr.findPatterns(patterns);
+                for (auto &match : matches) {
+                    std::cout << "Found \"" << patterns[match.pattern] << "\" at position " << match.pos << std::endl;
+                }
+                if (matches.empty()) {
+                    std::cout << "Text not found." << std::endl;
+                }
+                break;
+            }
+            case 29: {
+                std::cout << "Enter the text to find:\n";
+                std::string text;
+                std::getline(std::cin, text);
+                std::cout << "Enter the maximum number of edits:\n";
+                size_t maxEdits;
+                std::cin >> maxEdits;
+                std::cin.ignore();
+                arr.findApproximate(text, maxEdits);
+                break;
+            }
+            case 30: {
+                std::cout << "Enter the text to find:\n";
+                std::string text;
+                std::getline(std::cin, text);
+                std::cout << "Enter the position:\n";
+                size_t pos;
+                std::cin >> pos;
+                std::cin.ignore();
+                size_t next = arr.findText(text, SearchOptions(), pos + 1);
+                size_t previous = arr.findPrevious(text, SearchOptions(), pos);
+                if (next != SearchPattern::npos) {
+                    std::cout << "Next match at position " << next << std::endl;
+                } else {
+                    std::cout << "No next match." << std::endl;
+                }
+                if (previous != SearchPattern::npos) {
+                    std::cout << "Previous match at position " << previous << std::endl;
+                } else {
+                    std::cout << "No previous match." << std::endl;
+                }
+                break;
+            }
+            case 31: {
+                std::cout << "Enter the text to find:\n";
+                std::string text;
+                std::getline(std::cin, text);
+                std::cout << "Enter 1 to ignore case and 1 to match whole words only (e.g. 1 0):\n";
+                SearchOptions options;
+                std::cin >> options.ignoreCase >> options.wholeWord;
+                std::cin.ignore();
+                const std::vector<size_t>& matches = arr.findAll(text, options);
+                std::cout << "Found " << matches.size() << " matches";
+                for (size_t i = 0; i < matches.size(); i++) {
+                    std::cout << (i == 0 ? ": " : ", ") << matches[i];
+                }
+                std::cout << std::endl;
+                break;
+            }
+            case 32: {
+                std::cout << "Enter the syntax (c, ini or none):\n";
+                std::string name;
+                std::getline(std::cin, name);
+                if (arr.setSyntax(name)) {
+                    std::cout << "Syntax set to " << name << std::endl;
+                }
+                break;
+            }
+            case 33: {
+                std::cout << "Enter the line number:\n";
+                size_t line;
+                std::cin >> line;
+                std::cin.ignore();
+                arr.printTokens(line);
+                break;
+            }
+            case 34: {
+                std::cout << "Enter the position of the bracket:\n";
+                size_t pos;
+                std::cin >> pos;
+                std::cin.ignore();
+                size_t match = arr.matchBracket(pos);
+                if (match != SIZE_MAX) {
+                    std::cout << "Matching bracket at position " << match << std::endl;
+                } else {
+                    std::cout << "No matching bracket." << std::endl;
+                }
+                break;
+            }
+            case 35: {
+                std::cout << "Enter the position:\n";
+                size_t pos;
+                std::cin >> pos;
+                std::cin.ignore();
+                size_t open, close;
+                if (!arr.enclosingBlock(pos, open, close)) {
+                    std::cout << "No enclosing brackets." << std::endl;
+                } else if (close == SIZE_MAX) {
+                    std::cout << "Enclosing bracket at position " << open << " is never closed." << std::endl;
+                } else {
+                    std::cout << "Enclosed by brackets at positions " << open << " and " << close << std::endl;
+                }
+                break;
+            }
+            case 36: {
+                arr.sortLines();
+                break;
+            }
+            case 37: {
+                arr.uniqueLines();
+                break;
+            }
+            case 38: {
+                std::cout << "Enter the text to look for:\n";
+                std::string text;
+                std::getline(std::cin, text);
+                std::cout << "Enter 1 to keep the lines containing it or 0 to remove them:\n";
+                bool keepMatches;
+                std::cin >> keepMatches;
+                std::cin.ignore();
+                arr.filterLines(text, SearchOptions(), keepMatches);
+                break;
+            }
+            case 39:
+            case 40: {
+                std::cout << "Enter the first line, last line, column and width:\n";
+                size_t firstLine, lastLine, column, width;
+                std::cin >> firstLine >> lastLine >> column >> width;
+                std::cin.ignore();
+                if (choice == 39) {
+                    arr.copyBlock(firstLine, lastLine, column, width);
+                } else {
+                    arr.deleteBlock(firstLine, lastLine, column, width);
+                }
+                break;
+            }
+            case 41: {
+                std::cout << "Enter the first line, last line and column:\n";
+                size_t firstLine, lastLine, column;
+                std::cin >> firstLine >> lastLine >> column;
+                std::cin.ignore();
+                std::cout << "Enter the text to insert:\n";
+                std::string text;
+                std::getline(std::cin, text);
+                arr.insertBlock(firstLine, lastLine, column, text);
+                break;
+            }
+            case 42: {
+                std::cout << "Enter the line and column:\n";
+                size_t line, column;
+                std::cin >> line >> column;
+                std::cin.ignore();
+                arr.pasteBlock(line, column);
+                break;
+            }
+            case 43: {
+                std::cout << "Enter the anchor position (edits are recorded relative to it):\n";
+                size_t anchor;
+                std::cin >> anchor;
+                std::cin.ignore();
+                arr.startRecording(anchor);
+                break;
+            }
+            case 44: {
+                arr.stopRecording();
+                break;
+            }
+            case 45: {
+                std::cout << "Enter the number of times to replay:\n";
+                size_t times;
+                std::cin >> times;
+                std::cin.ignore();
+                arr.replayMacro(times);
+                break;
+            }
+            case 46: {
+                std::cout << "Enter the text to find:\n";
+                std::string text;
+                std::getline(std::cin, text);
+                arr.replayMacroAtMatches(text, SearchOptions());
+                break;
+            }
+            case 47: {
+                std::cout << "Enter the session filename:\n";
+                std::string filename;
+                std::getline(std::cin, filename);
+                arr.saveSession(filename);
+                break;
+            }
+            case 48: {
+                std::cout << "Enter the session filename:\n";
+                std::string filename;
+                std::getline(std::cin, filename);
+                arr.loadSession(filename);
+                break;
+            }
+            case 49: {
+                std::cout << "Enter 1 to use index sidecar files or 0 not to:\n";
+                bool enabled;
+                std::cin >> enabled;
+                std::cin.ignore();
+                arr.setIndexSidecar(enabled);
+                break;
+            }
+            case 50: {
+                std::cout << "Enter the file name:\n";
+                std::string filename;
+                std::getline(std::cin, filename);
+                arr.verifyFile(filename);
+                break;
+            }
+            case 51:
+                arr.showChunkStorage();
+                break;
+            case 52:
+                documents.push_back(arr.clone());
+                current = documents.size() - 1;
+                std::cout << "Now editing document " << current + 1 << " of " << documents.size() << std::endl;
+                break;
+            case 53: {
+                std::cout << "Enter the document number (1 to " << documents.size() << "):\n";
+                size_t number;
+                std::cin >> number;
+                std::cin.ignore();
+                if (number < 1 || number > documents.size()) {
+                    std::cout << "Invalid document number.\n";
+                    break;
+                }
+                current = number - 1;
+                std::cout << "Now editing document " << number << " of " << documents.size() << std::endl;
+                break;
+            }
             case 0:
                 return 0;
             default: